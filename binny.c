@@ -1,7 +1,20 @@
+#define _GNU_SOURCE /* for SEEK_DATA and SEEK_HOLE*/
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <time.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*NOTE: This could be curses.h or ncurses.h. Depends on the distro. */
 #include <ncurses.h>
@@ -25,7 +38,8 @@
 
 #define BYTES_PER_LINE_DEFAULT 	0x10
 #define BYTES_PER_GROUP_DEFAULT 4
-#define RIGHT_OFFSET 			13
+#define OFFSET_DIGITS			8 /* fewest hex digits offsets are shown with, buffers past 4GB get more */
+#define RIGHT_OFFSET 			(offsetDigits() + 5) /* "0x", the offset, then " | " */
 #define ASCII_OFFSET 			0
 #define SEPARATOR 				'|'
 #define BUFFER_LENGTH 			255
@@ -35,59 +49,534 @@
 #define MODE_BINARY	0
 #define MODE_ASCII	1
 
+#define CHUNK_SIZE				0x10000 /* unit of file IO and caching */
+#define CACHE_SLOTS				256 /* 16MB of read cache */
+#define PREFETCH_DEPTH			16 /* chunks read ahead of the cursor in the scroll direction */
+
+#define WHEEL_LINES				3
+#define HELD_KEY_GAP			100 /* milliseconds, a key repeating faster than this is being held down */
+#define HELD_KEY_RAMP			8 /* repeats before a held key speeds up, and between each doubling */
+#define HELD_KEY_MAX_SHIFT		24 /* keeps doubling long enough to cross a very large file in a few seconds */
+#define TYPEAHEAD_MAX			64 /* keys handled between redraws when they're queued up */
+#define KEY_PASTE_BEGIN			(KEY_MAX + 1) /* bracketed paste markers, given their own key codes in setupScreen */
+#define KEY_PASTE_END			(KEY_MAX + 2)
+#define PASTE_TIMEOUT			1000 /* milliseconds to wait on a paste that stops before its end marker */
+
+#define DIRECTION_BACKWARD		-1
+#define DIRECTION_FORWARD		1
+
+#define GZ_CHECKPOINT_SPAN		0x400000 /* decompressed bytes between index checkpoints */
+#define GZ_WINDOW_SIZE			32768 /* deflate history needed to resume at a checkpoint */
+#define GZ_INPUT_SIZE			0x10000
+#define GZ_TRAILER_SIZE			8
+
+#define SPARSE_BLOCK			4096 /* zero runs at least this long are left as holes on save */
+
+#define STREAM_BUFFER_SIZE		0x400000 /* IO size for --dump and --undump */
+#define DUMP_SLICE				0x4000 /* bytes --dump hex encodes at a time, so they're still in cache when the lines are built */
+#define DUMP_OUTPUT				0x100000 /* text --dump builds up before each write */
+
+#define HEADLESS_NONE			0
+#define HEADLESS_DUMP			1
+#define HEADLESS_UNDUMP			2
+
+#define STRINGS_MIN_DEFAULT		4
+#define STRINGS_MAX_THREADS		8
+#define CHUNK_PENDING			0
+#define CHUNK_SCANNING			1
+#define CHUNK_SCANNED			2
+#define STRINGS_PANEL_ROWS		256
+#define STRINGS_PANEL_COLS		512
+
+#define SIGNATURES_MAX			1024
+#define SIGNATURE_MAX_LENGTH	64
+#define SIGNATURE_NAME_LENGTH	32
+#define SIGNATURE_LANES			8 /* independent automaton walks per chunk, scanSignaturesChunk unrolls them */
+#define PRAGMA(x)				_Pragma(#x)
+#define UNROLL(n)				PRAGMA(GCC unroll n) /* #pragma itself won't take a macro for the count */
+#define AC_MATCH				0x80000000u /* set on automaton transitions into a state that reports signatures */
+
+#define RECORD_MAX_PERIOD		512 /* longest record the line length can be set to */
+#define RECORD_SAMPLE_BLOCKS	256 /* CHUNK_SIZE blocks looked at, longer ranges are sampled evenly */
+#define RECORD_TILE				4080 /* bytes compared at every lag in one go, 255 SSE2 steps */
+#define RECORD_MIN_CONTRAST		0.05 /* how much more often bytes match a record apart than on average */
+
+#define JOURNAL_INTERVAL_DEFAULT	5 /* seconds between autosaves to the recovery journal */
+#define JOURNAL_SUFFIX			".binny-journal"
+#define JOURNAL_MAGIC			"BINNYJ01"
+#define JOURNAL_HEADER			32 /* magic, then the size and modification time of the file the edits apply to */
+#define JOURNAL_RECORD_HEADER	17 /* type byte, then two 64 bit numbers */
+#define JOURNAL_BLOCK			0x100000 /* most data in one record */
+
+#define SESSION_MAGIC			"BINNYS01"
+#define SESSION_SUFFIX			".session"
+#define SESSION_ENTRY			6 /* a saved string or hit, 16 bit offset into its chunk then 32 bits of length or signature */
+#define BOOKMARKS_MAX			64
+#define FNV_OFFSET				0xcbf29ce484222325ull
+#define FNV_PRIME				0x100000001b3ull
+
+#define TEMPLATE_MAX_FIELDS		256
+#define TEMPLATE_NAME_LENGTH	24
+#define TEMPLATE_MAX_SIZE		CHUNK_SIZE /* longest record a template can describe */
+#define OVERLAY_WIDTH			40 /* most columns given to the decoded record beside the editor */
+#define OVERLAY_MIN_WIDTH		24 /* fewer than this and the editor's lines wrap instead */
+#define OVERLAY_COLOURS			6 /* fields take turns with these, see setupScreen */
+#define FIELD_UNSIGNED			0
+#define FIELD_SIGNED			1
+#define FIELD_FLOAT				2
+#define FIELD_CHAR				3
+#define FIELD_BYTES				4
+
+/* what the strings scan counts as text, same as strings(1)*/
+#define IS_STRING_CHAR(b)		(((b) >= 0x20 && (b) <= 0x7e) || (b) == '	')
+
+/* a chunk of the file as it is on disk. index is -1 when the slot is empty */
+typedef struct
+{
+    long index;
+    unsigned char * data;
+    unsigned long lastUsed;
+} CacheSlot;
+
+/* a chunk that has been edited and is waiting to be saved */
+typedef struct
+{
+    long index;
+    unsigned char * data;
+} DirtyChunk;
+
+/* a stretch of the file that has data on disk, [start, end). The gaps between them are holes */
+typedef struct
+{
+    unsigned long start;
+    unsigned long end;
+} DataExtent;
+
+/* a printable run found by the strings scan. wide is set for UTF-16LE, where length counts characters */
+typedef struct
+{
+    unsigned long offset;
+    unsigned int length;
+    int wide;
+} StringEntry;
+
+/* the strings found in one chunk. version goes up whenever the chunk is edited, so a scan that raced an edit gets redone */
+typedef struct
+{
+    StringEntry * entries;
+    int count;
+    int state;
+    unsigned int version;
+} StringsChunk;
+
+/* a byte pattern to look for, from a signature file */
+typedef struct
+{
+    char name[SIGNATURE_NAME_LENGTH];
+    unsigned char bytes[SIGNATURE_MAX_LENGTH];
+    int length;
+} Signature;
+
+typedef struct
+{
+    unsigned long offset;
+    int signature;
+} SignatureHit;
+
+/* the signature hits that start in one chunk, kept the same way as StringsChunk */
+typedef struct
+{
+    SignatureHit * hits;
+    int count;
+    int state;
+    unsigned int version;
+} HitChunk;
+
+/* one thread's share of the record size autocorrelation, it takes every step'th sampled block */
+typedef struct
+{
+    unsigned char * data;
+    long * lengths;
+    long blocks;
+    int first;
+    int step;
+    int maxLag;
+    uint64_t matches[RECORD_MAX_PERIOD + 1];
+} RecordScan;
+
+/* one line of a structure template. count is more than 1 for arrays, offset is from the start of the record */
+typedef struct
+{
+    char name[TEMPLATE_NAME_LENGTH];
+    int type;
+    int size; /* bytes in one element */
+    int bigEndian;
+    int count;
+    int offset;
+} TemplateField;
+
+/* a stretch of the buffer changed since the last autosave, or a resize to length when resize is set.
+ * Kept in the order they happened, since a resize cuts off whatever was written past it */
+typedef struct
+{
+    unsigned long start;
+    unsigned long length;
+    int resize;
+} JournalEdit;
+
+/* a spot in a gzip file where decompression can be picked up again without starting from the top */
+typedef struct
+{
+    unsigned long out; /* offset in the decompressed stream */
+    unsigned long in; /* offset in the file of the first whole byte after the checkpoint */
+    int bits; /* bits of the byte before 'in' that still belong to the next block, 0-7 */
+    unsigned char * window; /* the last GZ_WINDOW_SIZE bytes of output before 'out' */
+} GzCheckpoint;
+
 FILE * fp;
 char filename[BUFFER_LENGTH];
-unsigned char* buffer;
 char userInput[BUFFER_LENGTH];
 char userOutput[BUFFER_LENGTH];
 unsigned long bufferLength;
+unsigned long backingLength; /* bytes at the start of the buffer that come from the file, everything after reads as zero */
+int preallocate = 0; /* the next save allocates the space a resize added on disk, rather than leaving it a hole */
 WINDOW * borderWin;
 WINDOW * editorWin;
 WINDOW * userWin;
 WINDOW * popupWin;
+/* what the terminal has been sent, counted from the kernel's tally of this thread's writes. ncurses
+ * only sends the cells that changed since the last frame, these show how much that comes to */
+int ioStatsFd = -1;
+unsigned long frameCount = 0; /* frames that sent anything */
+unsigned long frameBytes = 0;
+unsigned long lastFrameBytes = 0;
+unsigned long lastFrameWrites = 0;
 
 int bufferModified = 0;
+/* set by a signal asking us to go. The handler does nothing else, the main loop sees it within a timeout and
+ * leaves through attemptCleanExit, outside the handler where taking locks and joining threads is safe */
+volatile sig_atomic_t exitSignal = 0;
 
-int curBufPos = 0;
+long curBufPos = 0;
 int curBufPosHalf = 0;
-int topLineOfScreen = 0; /* used to track how far down it's scrolled*/
+long topLineOfScreen = 0; /* used to track how far down it's scrolled*/
 
 int bytesPerLine = BYTES_PER_LINE_DEFAULT;
 int bytesPerGroup = BYTES_PER_GROUP_DEFAULT;
 int showASCII = 0;
 int mode = MODE_BINARY;
+int headlessMode = HEADLESS_NONE;
+
+/* for speeding up held keys */
+int lastKey = ERR;
+struct timespec lastKeyTime;
+long keyRepeats = 0;
+int keyFileStart = 0; /* ctrl-home and ctrl-end, if the terminal has them */
+int keyFileEnd = 0;
+int pasteEnabled = 0; /* the terminal has been asked to bracket pastes, ask it to stop on the way out */
+
+/* the chunk cache sits between the screen and the file. Edits live in dirtyChunks until saved.
+ * Everything in here is shared with the prefetch thread and protected by cacheLock */
+CacheSlot chunkCache[CACHE_SLOTS];
+DirtyChunk * dirtyChunks = NULL; /* sorted by index */
+int dirtyChunkCount = 0;
+int dirtyChunkCapacity = 0;
+unsigned long cacheClock = 0;
+unsigned long cacheGeneration = 0; /* bumped whenever the file changes under the cache */
+unsigned long cacheHits = 0;
+unsigned long cacheMisses = 0;
+unsigned long cachePrefetched = 0;
+long prefetchTarget = 0;
+int prefetchDirection = DIRECTION_FORWARD;
+int prefetchRunning = 0;
+pthread_t prefetchThread;
+pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t prefetchCond = PTHREAD_COND_INITIALIZER;
+/* where the file has data according to SEEK_DATA/SEEK_HOLE. Holes read as zero without touching the disk.
+ * Sorted and protected by cacheLock too */
+DataExtent * dataExtents = NULL;
+int dataExtentCount = 0;
+int holesMapped = 0;
+
+/* gzip input is shown decompressed. A background thread walks the whole file once, leaving checkpoints
+ * behind, and the buffer grows as it goes. Index state is protected by gzIndexLock */
+int compressedInput = 0;
+int showRaw = 0;
+GzCheckpoint * gzCheckpoints = NULL;
+int gzCheckpointCount = 0;
+int gzCheckpointCapacity = 0;
+unsigned long gzIndexedLength = 0; /* decompressed bytes that can be read so far */
+unsigned long gzIndexedInput = 0;
+unsigned long gzFileSize = 0;
+int gzIndexState = 0; /* 0 running, 1 done, -1 the file is damaged */
+int gzIndexRunning = 0;
+pthread_t gzIndexThread;
+pthread_mutex_t gzIndexLock = PTHREAD_MUTEX_INITIALIZER;
+/* decompressor left wherever the last read stopped, so reading forward carries on rather than restarting */
+z_stream gzReader;
+int gzReaderValid = 0;
+int gzReaderRaw = 0;
+unsigned long gzReaderOut = 0;
+unsigned long gzReaderIn = 0;
+unsigned char gzReaderInput[GZ_INPUT_SIZE];
+pthread_mutex_t gzReadLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* strings index, built on demand by a pool of threads that each take the next pending chunk.
+ * Protected by stringsLock */
+int stringsMinLength = STRINGS_MIN_DEFAULT;
+StringsChunk * stringsChunks = NULL;
+long stringsChunkCount = 0;
+long stringsScanFrom = 0; /* no chunk before this one is pending */
+long stringsScanned = 0;
+long stringsFound = 0;
+unsigned long stringsLength = 0;
+int stringsRunning = 0;
+int stringsThreadCount = 0;
+pthread_t stringsThreads[STRINGS_MAX_THREADS];
+pthread_mutex_t stringsLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t stringsCond = PTHREAD_COND_INITIALIZER;
+
+/* signatures loaded from a file and the Aho-Corasick automaton built from them. Only changed while no scan is running */
+char signatureFile[BUFFER_LENGTH] = "";
+Signature * signatures = NULL;
+int signatureCount = 0;
+int signatureMaxLength = 0;
+int signatureZeroStart = 0; /* some signature starts with a zero byte, so holes can't be skipped */
+unsigned char acClass[256]; /* byte to column in a state's row */
+int acClassCount = 0;
+uint32_t * acTable = NULL;
+int acStateCount = 0;
+int * acOutStart = NULL; /* where each state's signatures start in acOutList */
+int * acOutCount = NULL;
+int * acOutList = NULL;
+/* hits index, built by a pool of threads like the strings index. Protected by hitsLock */
+HitChunk * hitChunks = NULL;
+long hitChunkCount = 0;
+long hitsScanFrom = 0;
+long hitsScanned = 0;
+long hitsFound = 0;
+unsigned long hitsLength = 0;
+int hitsRunning = 0;
+int hitsThreadCount = 0;
+pthread_t hitsThreads[STRINGS_MAX_THREADS];
+pthread_mutex_t hitsLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t hitsCond = PTHREAD_COND_INITIALIZER;
+
+/* edits waiting for the next autosave, protected by journalLock. The journal file itself is only touched
+ * with journalFileLock held, which is taken first */
+int journalInterval = JOURNAL_INTERVAL_DEFAULT;
+JournalEdit * journalEdits = NULL;
+long journalEditCount = 0;
+long journalEditCapacity = 0;
+int journalFd = -1;
+int journalRunning = 0;
+int journalFailed = 0; /* 1 when a write failed and the user hasn't been told yet, 2 once they have */
+pthread_t journalThread;
+pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t journalFileLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journalCond = PTHREAD_COND_INITIALIZER;
+
+/* offsets marked with 'M', sorted. They're kept in the session along with the cursor and layout, which is
+ * saved on the way out and picked up next time the same file is opened */
+unsigned long bookmarks[BOOKMARKS_MAX];
+int bookmarkCount = 0;
+int sessionEnabled = 0;
+int layoutFromOptions = 0; /* -l, -g or -a were given, which win over what the session had */
+
+/* a structure template laid over the buffer from overlayStart, repeated overlayRecords times, or as many as fit
+ * when that's -1. Records are all templateSize long, so which record and field a byte is in comes straight from
+ * its offset and nothing is decoded until it's on screen. overlayWin is NULL while it isn't showing */
+char templateFile[BUFFER_LENGTH] = "";
+TemplateField * templateFields = NULL;
+int templateFieldCount = 0;
+int templateSize = 0;
+int templateNameWidth = 0;
+unsigned char * templateFieldAt = NULL; /* the field each byte of a record belongs to */
+unsigned long overlayStart = 0;
+long overlayRecords = -1;
+WINDOW * overlayWin = NULL;
+int overlayColours = 0;
+
+/* the last find or replace pattern, and the match it last landed on, which is highlighted */
+unsigned char searchPattern[SIGNATURE_MAX_LENGTH];
+int searchLength = 0;
+long matchOffset = -1;
+int matchLength = 0;
+/* time spent waiting on askReplace, which is left out of the replace speed*/
+double replaceWaited = 0;
 
 /*FUNCTION PROTOTYPES*/
 void printHelp();
 int parseOptions(int argc, char ** argv);
-int resizeBuffer(int newSize);
+int resizeBuffer(long newSize);
 void attemptCleanExit(int status);
-void resizeSignalHandler(int signum);
+void resizeScreen();
+void refreshScreen();
+int readWriteCounters(unsigned long * bytes, unsigned long * calls);
 void sigintHandler(int signum);
 int setupScreen();
-void drawASCII(int n);
+void drawASCII(long line, unsigned char * lineBytes);
 void drawEditorWin();
 void drawBorderWin();
 void drawUserWin();
-void moveEditorCursorUp();
-void moveEditorCursorDown();
+void moveEditorCursorLines(long lines);
 void moveEditorCursorLeft();
 void moveEditorCursorRight();
 void moveCursorToScreenPos();
+void scrollEditor(long lines);
+void moveCursorToEdge(int toEnd, int wholeFile);
+void moveCursorToClick(int row, int col);
+long keyAcceleration(int c);
+int handleNavigation(int c);
 void handleInput(int c);
 void handleScrolling();
-int leastOf(int x, int y);
+long leastOf(long x, long y);
+int offsetDigits();
 void inputPopup();
 int saveBuffer();
+void editNibble(int value);
+long compactHex(char * text, long len);
+void pasteInput();
+int initChunkCache();
+void stopChunkCache();
+int loadChunk(long index, unsigned char * dest);
+void installChunk(long index, unsigned char * data, unsigned long generation);
+void invalidateChunkCache();
+DirtyChunk * findDirtyChunk(long index);
+DirtyChunk * getDirtyChunk(long index);
+unsigned long copyBuffer(unsigned long pos, unsigned char * dest, unsigned long len, int keep);
+unsigned long readBuffer(unsigned long pos, unsigned char * dest, unsigned long len);
+unsigned long peekBuffer(unsigned long pos, unsigned char * dest, unsigned long len);
+unsigned char getBufferByte(unsigned long pos);
+void setBufferByte(unsigned long pos, unsigned char value);
+void fillBuffer(unsigned long pos, unsigned char value, unsigned long len);
+void requestPrefetch(int direction);
+void * prefetchWorker(void * arg);
+int mapHoles();
+int findExtent(unsigned long pos);
+int rangeIsHole(unsigned long start, unsigned long len);
+long nextDataOffset(unsigned long pos, int direction);
+int isZeroBlock(const unsigned char * data, unsigned long len);
+int writeSparse(int fd, const unsigned char * data, unsigned long len, unsigned long pos, int checkHoles);
+int openCompressed();
+void closeCompressed();
+void pollCompressed();
+void * gzIndexWorker(void * arg);
+int addGzCheckpoint(int bits, unsigned long in, unsigned long out, unsigned left, unsigned char * window);
+int seekGzReader(unsigned long pos);
+long inflateGzReader(unsigned char * dest, unsigned long len);
+int readCompressed(unsigned long start, unsigned char * dest, unsigned long len);
+int saveDecompressed();
+int startStrings();
+void stopStrings();
+void syncStrings();
+void markStringsStale(unsigned long pos, unsigned long len);
+void classifyPrintable(const unsigned char * data, int len, uint64_t * printable, uint64_t * zero);
+long nextBit(const uint64_t * bitmap, long from, long end, int value);
+unsigned long extendString(unsigned long pos, int wide);
+int scanStringsChunk(long index, unsigned char * data, uint64_t * printable, uint64_t * zero, StringEntry ** found);
+void * stringsWorker(void * arg);
+int compareStrings(const void * a, const void * b);
+int stepString(long * chunk, int * entry, int direction);
+void stringsPanel();
+int loadSignatures(const char * path);
+void freeAutomaton();
+int buildAutomaton();
+int startSignatures();
+void stopSignatures();
+void syncSignatures();
+void markSignaturesStale(unsigned long pos, unsigned long len);
+int reportHits(uint32_t entry, long end, long from, long to, unsigned long start, SignatureHit ** hits, int count, int * capacity);
+int scanSignaturesChunk(long index, unsigned char * data, SignatureHit ** found);
+int compareHits(const void * a, const void * b);
+void * signaturesWorker(void * arg);
+int stepHit(long * chunk, int * hit, int direction);
+void markHits(long start, long end, char * marks);
+void signaturesPanel();
+int parsePattern(const char * text, unsigned char * dest, int max);
+unsigned long skipHoles(unsigned long pos);
+long findPattern(unsigned long from, const unsigned char * pattern, int len, unsigned char * block, unsigned long * blockStart, long * blockLength);
+void writeBuffer(unsigned long pos, const unsigned char * src, unsigned long len);
+double secondsSince(struct timespec * start);
+void findNext();
+int askReplace(unsigned long pos);
+int appendOutput(int fd, unsigned char * out, long * outFill, unsigned long * outPos, const unsigned char * src, unsigned long len, unsigned long * copyFrom);
+long replaceToFile(const char * outName, const unsigned char * replacement, int replacementLength, int interactive, unsigned long start);
+int reloadFile();
+void replacePattern();
+void decompressedName(char * name);
+uint64_t countMatches(const unsigned char * data, long len, int lag);
+void * recordWorker(void * arg);
+long findRecordSize(unsigned long start, unsigned long len, double * contrast);
+void detectRecordSize();
+void journalName(char * name);
+void journalEdit(unsigned long start, unsigned long length, int resize);
+int startJournal();
+void stopJournal();
+void discardJournal();
+void pollJournal();
+int compareJournalEdits(const void * a, const void * b);
+void fillJournalHeader(unsigned char * header);
+int writeJournalRecord(char type, unsigned long a, unsigned long b);
+int flushJournal();
+void * journalWorker(void * arg);
+long replayJournal(int fd, long limit);
+void offerRecovery();
+uint64_t hashBytes(uint64_t hash, const void * data, long len);
+char * sessionName(char * name, int create);
+uint64_t signaturesHash();
+int writeSessionNumber(FILE * out, uint64_t value);
+int readSessionNumber(FILE * in, uint64_t * value);
+long sessionRemaining(FILE * in);
+int saveStringsIndex(FILE * out);
+int saveHitsIndex(FILE * out);
+int loadStringsIndex(FILE * in);
+int loadHitsIndex(FILE * in);
+void saveSession();
+void loadSession();
+void toggleBookmark();
+void nextBookmark();
+int parseFieldType(const char * text, TemplateField * field);
+int loadTemplate(const char * path);
+long overlayRecordCount();
+int overlayWidth();
+int overlayAttr(int field);
+uint64_t fieldElement(const TemplateField * field, const unsigned char * data);
+void formatField(const TemplateField * field, const unsigned char * data, char * text, int width);
+void showOverlay();
+void hideOverlay();
+void drawOverlayWin();
+void overlayInput();
+void encodeHex(const unsigned char * src, long n, char * dest);
+void encodeAscii(const unsigned char * src, long n, char * dest);
+long decodeHex(const char * src, long n, unsigned char * dest);
+long hexRunLength(const char * src, long n);
+int hexValue(char c);
+long readFully(int fd, gzFile in, unsigned char * dest, long len);
+int writeFully(int fd, const void * src, long len);
+int dumpFile();
+int undumpFile();
+int flushUndump(const unsigned char * outBuf, long * outLen);
+long decodeGroups(const char * g, const char * lineEnd, long width, char * lineHex, unsigned char * dest);
 
 int main(int argc, char** argv)
 {
     int ch = 0;
+    int i;
+    struct sigaction action;
 
     if (parseOptions(argc, argv))
     {
         return EXIT_FAILURE;
     }
+    if (headlessMode == HEADLESS_DUMP)
+    {
+        return dumpFile() ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (headlessMode == HEADLESS_UNDUMP)
+    {
+        return undumpFile() ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
 
     /*===FILE IO OPERATIONS=== */
 
@@ -117,35 +606,95 @@ int main(int argc, char** argv)
             attemptCleanExit(EXIT_FAILURE);
         }
         fseek(fp, 0, SEEK_SET);
-        buffer = malloc(sizeof(char) * (bufferLength));
-        fread(buffer, sizeof(char), bufferLength, fp);
+        backingLength = bufferLength;
+        /* nothing is read up front, the chunk cache pulls in whatever gets looked at */
+
+        if (!showRaw && openCompressed())
+        {
+            printf("%s: Couldn't start decompressing %s.\n", PROG_NAME, filename);
+            attemptCleanExit(EXIT_FAILURE);
+        }
     }
     else
     {
         bufferLength = NEW_FILE_BUFFER_SIZE;
-        buffer = malloc(sizeof(char) * (bufferLength));
-        memset(buffer, 0, bufferLength);
+        backingLength = 0;
         bufferModified = 1;
     }
 
+    if (fp != NULL && !compressedInput) mapHoles();
+    if (initChunkCache())
+    {
+        printf("%s: Couldn't start the read cache.\n", PROG_NAME);
+        attemptCleanExit(EXIT_FAILURE);
+    }
+    if (strlen(signatureFile) > 0 && loadSignatures(signatureFile))
+    {
+        printf("%s: %s\n", PROG_NAME, userOutput);
+        attemptCleanExit(EXIT_FAILURE);
+    }
+    /* laid over the whole file from the start, 'O' moves it*/
+    if (strlen(templateFile) > 0 && loadTemplate(templateFile))
+    {
+        printf("%s: %s\n", PROG_NAME, userOutput);
+        attemptCleanExit(EXIT_FAILURE);
+    }
+    /* after the signatures, so a saved hits index can be checked against them*/
+    if (!compressedInput) loadSession();
+    if (strlen(signatureFile) > 0)
+    {
+        /* scan straight away so the hits show up as they're found, or finish what the session had*/
+        if (startSignatures())
+        {
+            printf("%s: %s\n", PROG_NAME, userOutput);
+            attemptCleanExit(EXIT_FAILURE);
+        }
+        if (hitsScanned < hitChunkCount) sprintf(userOutput, "Scanning for %d signatures, 'F' lists the hits.", signatureCount);
+    }
+
     /*SIGNALS HANDLING*/
-    signal(SIGINT, sigintHandler);
-#ifdef SIGWINCH
-    signal(SIGWINCH, resizeSignalHandler);/*when the terminal is resized*/
-#endif
+    /* no SA_RESTART, so a read waiting on a key gives up when one arrives rather than carrying on*/
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sigintHandler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    /* a dropped ssh session hangs up, going out the same way gets the last edits into the journal*/
+    sigaction(SIGHUP, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    /* SIGWINCH is left to ncurses, which turns it into KEY_RESIZE*/
 
     if (setupScreen())
     {
         attemptCleanExit(EXIT_FAILURE);
     }
+    if (!compressedInput && journalInterval > 0)
+    {
+        offerRecovery();
+        if (startJournal()) sprintf(userOutput, "Error: Couldn't start autosaving, edits won't be recoverable.");
+    }
 
     /*begin main loop*/
     while (1)
     {
         ch = getch();
-        handleInput(ch);
+        /* a held key queues up faster than the screen draws, so handle what's waiting before drawing again*/
+        for (i = 0; ch != ERR && i < TYPEAHEAD_MAX && !exitSignal; i++)
+        {
+            handleInput(ch);
+            timeout(0);
+            ch = getch();
+        }
+        if (exitSignal) attemptCleanExit(EXIT_SUCCESS);
+        if (ch != ERR) ungetch(ch);
+        timeout(250);
+        pollCompressed();
+        pollJournal();
+        syncStrings();
+        syncSignatures();
         drawUserWin();
+        drawOverlayWin();
         drawEditorWin();
+        refreshScreen();
     }
 
     /*We should never get here*/
@@ -156,25 +705,52 @@ void printHelp()
 {
     printf("%s v%s\n", PROG_NAME, VERSION);
     printf("A simple in-place binary editor.\n");
-    printf("Usage:\n\t%s [OPTIONS] FILENAME\n", PROG_NAME);
-    printf("Options:\n\t-h\t\tPrint Help\n\t-a\t\tShow ASCII\n\t-l bytes\tSet bytes displayed per line, default 0x10\n\t-g bytes\tSet byte grouping, default 4\n");
+    printf("Usage:\n\t%s [OPTIONS] FILENAME\n\t%s --dump [-l bytes] [-g bytes] [-a] FILENAME > DUMP\n\t%s --undump DUMP > FILENAME\n", PROG_NAME, PROG_NAME, PROG_NAME);
+    printf("Options:\n\t-h\t\tPrint Help\n\t-a\t\tShow ASCII\n\t-l bytes\tSet bytes displayed per line, default 0x10\n\t-g bytes\tSet byte grouping, default 4\n\t-r\t\tShow gzip files as they are instead of decompressed\n\t-n length\tSet minimum string length for the strings list, default 4\n\t-s file\t\tLoad a signature list and highlight where they match\n");
+    printf("\t-t file\t\tLay a structure template over the file, see 'O'\n");
+    printf("\t-j seconds\tAutosave edits to FILENAME%s this often, default %d, 0 turns it off\n", JOURNAL_SUFFIX, JOURNAL_INTERVAL_DEFAULT);
+    printf("\t--dump\t\tWrite a hex dump of FILENAME to stdout in the editor's layout, - reads stdin\n\t--undump\tTurn a dump back into binary on stdout\n");
     printf("Commands:\nAll commands are issued with shift-<command key>.\n");
     printf("\tQ\t\tquit - Exit the program\n");
     printf("\tS\t\tsave - Save the buffer to the file\n");
     printf("\tG\t\tgoto - Jump to a position in the buffer\n");
-    printf("\tR\t\tresize - Resize the current buffer\n");
+    printf("\tR\t\tresize - Resize the current buffer, new space reads as zeros and costs nothing until it's written to\n");
     printf("\tA\t\tascii_insert - Insert a string of ascii\n");
     printf("\tB\t\tbatch_insert - Insert a value repeatedly\n");
+    printf("\tI\t\tinfo - Show read cache statistics and how much the last screen update sent\n");
+    printf("\tT\t\ttext_strings - List the strings in the buffer and jump to one\n");
+    printf("\t/\t\tfind - Find hex bytes or \"text\" after the cursor, enter alone repeats the last one\n");
+    printf("\tX\t\treplace - Replace a pattern one match at a time or everywhere, lengths can differ\n");
+    printf("\tL\t\trecord_layout - Find the length of repeating records and line them up, one per line\n");
+    printf("\tF\t\tfind_signatures - List where the loaded signatures match and jump to one\n");
+    printf("\tN\t\tnext_data - Skip over the hole to the next stretch of data in a sparse file\n");
+    printf("\tP\t\tprev_data - Jump back to the start of the previous stretch of data\n");
+    printf("\tM\t\tmark - Bookmark the byte under the cursor, or take its bookmark off\n");
+    printf("\tJ\t\tjump - Jump to the next bookmark\n");
+    printf("\tO\t\toverlay - Lay a structure template over the buffer from an offset, or take it away\n");
+    printf("Moving:\n\tArrows, PgUp/PgDn and the mouse wheel move around, and speed up when held. Click to place the cursor.\n");
+    printf("\tHome/End go to the start or end of the line, pressed again (or with ctrl) of the file.\n");
+    printf("\tESC leaves ASCII mode.\n");
+    printf("Sessions:\n\tThe cursor, layout, bookmarks and the strings and signature indexes are kept in ~/.cache/%s and picked up\n", PROG_NAME);
+    printf("\tnext time the same file is opened, as long as it hasn't changed. -l, -g and -a win over the saved layout.\n");
+    printf("Pasting:\n\tA paste is written at the cursor in one go, as hex (spaces, commas and 0x are skipped) or as is in ASCII mode.\n");
 
 }
 
 int parseOptions(int argc, char** argv)
 {
     int ch;
+    static struct option longOptions[] =
+    {
+        {"dump", no_argument, NULL, 'D'},
+        {"undump", no_argument, NULL, 'U'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
 
     /*===OPTIONS PARSING===*/
     opterr = 0;
-    while ((ch = getopt(argc, argv, "hal:g:")) != -1)
+    while ((ch = getopt_long(argc, argv, "hal:g:rn:s:j:t:", longOptions, NULL)) != -1)
     {
         if (ch == 'h')
         {
@@ -188,10 +764,50 @@ int parseOptions(int argc, char** argv)
                 return EXIT_FAILURE;
             }
             bytesPerLine = strtol(optarg, NULL, 0);
+            layoutFromOptions = 1;
         }
         else if (ch == 'a')
         {
             showASCII = 1;
+            layoutFromOptions = 1;
+        }
+        else if (ch == 'r')
+        {
+            showRaw = 1;
+        }
+        else if (ch == 's')
+        {
+            snprintf(signatureFile, sizeof(signatureFile), "%s", optarg);
+        }
+        else if (ch == 't')
+        {
+            snprintf(templateFile, sizeof(templateFile), "%s", optarg);
+        }
+        else if (ch == 'D')
+        {
+            headlessMode = HEADLESS_DUMP;
+        }
+        else if (ch == 'U')
+        {
+            headlessMode = HEADLESS_UNDUMP;
+        }
+        else if (ch == 'n')
+        {
+            if (strtol(optarg, NULL, 0) < 1)
+            {
+                printf("%s: Bad argument '%s' in option '%c'. Use '%s -h' for Help.\n", PROG_NAME, optarg, ch, PROG_NAME);
+                return -1;
+            }
+            stringsMinLength = strtol(optarg, NULL, 0);
+        }
+        else if (ch == 'j')
+        {
+            if (strtol(optarg, NULL, 0) < 0)
+            {
+                printf("%s: Bad argument '%s' in option '%c'. Use '%s -h' for Help.\n", PROG_NAME, optarg, ch, PROG_NAME);
+                return -1;
+            }
+            journalInterval = strtol(optarg, NULL, 0);
         }
         else if (ch == 'g')
         {
@@ -201,6 +817,7 @@ int parseOptions(int argc, char** argv)
                 return -1;
             }
             bytesPerGroup = strtol(optarg, NULL, 0);
+            layoutFromOptions = 1;
         }
         else
         {
@@ -222,39 +839,118 @@ int parseOptions(int argc, char** argv)
     return 0;
 }
 
-//Will resize the buffer and copy all of buffer (that it can) into the new one. Returns the new size or -1 on Error*/
-int resizeBuffer(int newSize)
+//Will resize the buffer. Bytes past the old end read as zero. Returns 0, or -1 on Error*/
+int resizeBuffer(long newSize)
 {
+    int i, kept = 0;
+    long lastIndex;
     if (newSize <= 0)
     {
         sprintf(userOutput, "Error: New buffer size must be greater than 0.");
         return -1;
     }
-    unsigned char * newBuf = malloc(sizeof(char) * (newSize));
-    if (newBuf == NULL) return -1;
-    memset(newBuf, 0, newSize); /*zero the buffer just in case*/
-    memcpy(newBuf, buffer, leastOf(newSize, bufferLength));
-    free(buffer);
 
-    /*basically reset everything */
-    buffer = newBuf;
+    /* drop edits past the new end, and zero the tail of the last chunk so regrowing shows zeros*/
+    pthread_mutex_lock(&cacheLock);
+    lastIndex = (newSize - 1) / CHUNK_SIZE;
+    for (i = 0; i < dirtyChunkCount; i++)
+    {
+        if (dirtyChunks[i].index > lastIndex)
+        {
+            free(dirtyChunks[i].data);
+            continue;
+        }
+        if (dirtyChunks[i].index == lastIndex && newSize % CHUNK_SIZE != 0)
+        {
+            memset(dirtyChunks[i].data + (newSize % CHUNK_SIZE), 0, CHUNK_SIZE - (newSize % CHUNK_SIZE));
+        }
+        dirtyChunks[kept++] = dirtyChunks[i];
+    }
+    dirtyChunkCount = kept;
+    if (newSize < backingLength)
+    {
+        backingLength = newSize;
+        invalidateChunkCache();
+        /* the extents past the new end are gone too*/
+        while (dataExtentCount > 0 && dataExtents[dataExtentCount - 1].start >= newSize) dataExtentCount--;
+        if (dataExtentCount > 0 && dataExtents[dataExtentCount - 1].end > newSize) dataExtents[dataExtentCount - 1].end = newSize;
+    }
+    pthread_mutex_unlock(&cacheLock);
+
+    /* nothing is written here, the new length is applied when saving and anything past the file reads as zero*/
     bufferLength = newSize;
-    curBufPos = 0;
-    topLineOfScreen = 0;
+    journalEdit(newSize, 0, 1);
+    stopStrings(); /* chunk layout changed, the next 'T' rescans*/
+    stopSignatures();
+    while (bookmarkCount > 0 && bookmarks[bookmarkCount - 1] >= newSize) bookmarkCount--;
+    if (matchOffset + matchLength > newSize) matchOffset = -1;
+    if (curBufPos >= newSize)
+    {
+        curBufPos = newSize - 1;
+        curBufPosHalf = 0;
+    }
     return 0;
 }
 
-/* called when the terminal resize, then redraws everything.*/
-void resizeSignalHandler(int signum)
+/* called on KEY_RESIZE, ncurses has already resized stdscr so the windows inside it are fitted to match.
+ * The caller redraws them. */
+void resizeScreen()
 {
-    endwin();
-    setupScreen();
+    int rows, cols, overlayCols;
+
+    getmaxyx(borderWin, rows, cols);
+    if (overlayWin != NULL)
+    {
+        /* the overlay takes the right hand side, with a column between it and the editor*/
+        overlayCols = overlayWidth();
+        wresize(overlayWin, rows - 4, overlayCols);
+        mvwin(overlayWin, 1, cols - 1 - overlayCols);
+        wresize(editorWin, rows - 4, cols - 3 - overlayCols);
+    }
+    else wresize(editorWin, rows - 4, cols - 2);
+    wresize(userWin, 2, cols - 2);
+    mvwin(userWin, rows - 3, 1);
+    drawBorderWin();
+}
+
+/* Sends everything drawn since the last frame to the terminal in one go, and counts what that took. */
+void refreshScreen()
+{
+    unsigned long bytesBefore, callsBefore, bytesAfter, callsAfter;
+    int counted = readWriteCounters(&bytesBefore, &callsBefore) == 0;
+
+    doupdate();
+    if (counted && readWriteCounters(&bytesAfter, &callsAfter) == 0 && bytesAfter > bytesBefore)
+    {
+        lastFrameBytes = bytesAfter - bytesBefore;
+        lastFrameWrites = callsAfter - callsBefore;
+        frameBytes += lastFrameBytes;
+        frameCount++;
+    }
+}
+
+/* Reads the bytes and write calls this thread has made so far. Linux only, returns -1 elsewhere. */
+int readWriteCounters(unsigned long * bytes, unsigned long * calls)
+{
+    char text[512];
+    char * field;
+    long n;
+
+    if (ioStatsFd < 0) return -1;
+    n = pread(ioStatsFd, text, sizeof(text) - 1, 0);
+    if (n <= 0) return -1;
+    text[n] = 0;
+    if ((field = strstr(text, "wchar:")) == NULL) return -1;
+    *bytes = strtoul(field + 6, NULL, 10);
+    if ((field = strstr(text, "syscw:")) == NULL) return -1;
+    *calls = strtoul(field + 6, NULL, 10);
+    return 0;
 }
 
-/*Handles CTRL-C AKA SIGINT */
+/*Handles CTRL-C AKA SIGINT, and SIGHUP and SIGTERM. Only async-signal-safe work in here*/
 void sigintHandler(int signum)
 {
-    attemptCleanExit(EXIT_SUCCESS);
+    exitSignal = signum;
 }
 
 /*Does basic screen setup, with error checking*/
@@ -262,7 +958,7 @@ int setupScreen()
 {
     /*===NCURSES OPERATIONS===*/
     /*make sure we can init ncurses properly*/
-    int rows, cols;
+    int rows, cols, i;
 
     borderWin = initscr();
     if (borderWin == NULL)
@@ -270,23 +966,55 @@ int setupScreen()
         printf("Error: Couldn't initialize main screen.\n");
         return -1;
     }
+    /* until the screen has been left and come back to once, ncurses flushes on every cursor move, which
+     * splits a frame into a write per changed line. Do that now so each frame goes out in one write*/
+    endwin();
+    refresh();
 
     /*raw();*/
     cbreak();
     keypad(stdscr, TRUE);
     noecho(); /*Turns off character echoing to the screen*/
+    timeout(250); /* wake up now and then so background work shows up without a keypress*/
+    set_escdelay(25); /* ESC leaves ASCII mode and closes lists, so don't sit waiting for a sequence*/
+    mousemask(BUTTON1_PRESSED | BUTTON4_PRESSED | BUTTON5_PRESSED, NULL);
+    mouseinterval(0);
+    keyFileStart = key_defined("\033[1;5H");
+    keyFileEnd = key_defined("\033[1;5F");
+    /* pastes come wrapped in these, so the whole block can be taken in one go rather than key by key*/
+    if (define_key("\033[200~", KEY_PASTE_BEGIN) == OK && define_key("\033[201~", KEY_PASTE_END) == OK)
+    {
+        printf("\033[?2004h");
+        fflush(stdout);
+        pasteEnabled = 1;
+    }
 #ifdef _WIN32
     curs_set(2);
 #endif
 
+    /* template fields take turns with these colours in the hex, on whatever background the terminal has*/
+    if (has_colors() && start_color() == OK)
+    {
+        static const short fieldColours[OVERLAY_COLOURS] = {COLOR_CYAN, COLOR_GREEN, COLOR_YELLOW, COLOR_MAGENTA, COLOR_BLUE, COLOR_RED};
+        short background = use_default_colors() == OK ? -1 : COLOR_BLACK;
+        for (i = 0; i < OVERLAY_COLOURS; i++) init_pair(i + 1, fieldColours[i], background);
+        overlayColours = 1;
+    }
+
     getmaxyx(borderWin, rows, cols);
     editorWin = newwin(rows - 4, cols - 2, 1, 1);
     userWin = newwin(2, cols - 2, rows - 3, 1);
+    if (templateFieldCount > 0) showOverlay();
+
+    /* the draws happen on this thread, so its write count is what went to the terminal*/
+    if (ioStatsFd < 0) ioStatsFd = open("/proc/thread-self/io", O_RDONLY);
 
     /*first Draw*/
     drawBorderWin();
     drawUserWin();
+    drawOverlayWin();
     drawEditorWin();
+    refreshScreen();
     return 0;
 }
 
@@ -294,25 +1022,134 @@ void attemptCleanExit(int status)
 {
     delwin(editorWin);
     endwin();
+    if (pasteEnabled)
+    {
+        printf("\033[?2004l");
+        fflush(stdout);
+    }
+    stopJournal(); /* writes out whatever hasn't been autosaved yet, before the cache goes*/
+    saveSession(); /* before the indexes go*/
+    stopStrings();
+    stopSignatures();
+    stopChunkCache(); /* before the file goes, the prefetcher may still be reading it*/
+    closeCompressed();
     if (fp != NULL) {
 	fclose(fp);
         fp = NULL;
     }
-    free(buffer);
     exit(status);
 }
 
-void moveEditorCursorUp()
+/* moves the cursor up (negative) or down a number of lines, stopping at either end*/
+void moveEditorCursorLines(long lines)
 {
-    curBufPos -= bytesPerLine;
+    curBufPos += lines * bytesPerLine;
     curBufPosHalf = 0;
     if (curBufPos < 0) curBufPos = 0;
+    if (curBufPos >= bufferLength) curBufPos = bufferLength ? bufferLength - 1 : 0;
+    requestPrefetch(lines < 0 ? DIRECTION_BACKWARD : DIRECTION_FORWARD);
+}
+
+/* moves the view and the cursor together, so the cursor keeps its place on the screen. For paging and the wheel*/
+void scrollEditor(long lines)
+{
+    long rows = getmaxy(editorWin);
+    long lastTop = (bufferLength ? (bufferLength - 1) / bytesPerLine : 0) - rows + 1;
+
+    topLineOfScreen += lines;
+    if (topLineOfScreen > lastTop) topLineOfScreen = lastTop;
+    if (topLineOfScreen < 0) topLineOfScreen = 0;
+    moveEditorCursorLines(lines);
 }
-void moveEditorCursorDown()
+
+/* Home and End, for the line or the whole file. Pressed again at the edge of a line, they go on to the edge of the file*/
+void moveCursorToEdge(int toEnd, int wholeFile)
 {
-    curBufPos += bytesPerLine;
+    long lineStart = curBufPos - (curBufPos % bytesPerLine);
+    long target = toEnd ? lineStart + bytesPerLine - 1 : lineStart;
+    int direction = toEnd ? DIRECTION_FORWARD : DIRECTION_BACKWARD;
+
+    if (bufferLength == 0) return;
+    if (target >= bufferLength) target = bufferLength - 1;
+    if (wholeFile || (target == curBufPos && curBufPosHalf == 0)) target = toEnd ? bufferLength - 1 : 0;
+    curBufPos = target;
     curBufPosHalf = 0;
-    if (curBufPos >= bufferLength) curBufPos = bufferLength - 1;
+    requestPrefetch(direction);
+}
+
+/* puts the cursor on whatever byte was clicked, in either the hex or the ASCII column*/
+void moveCursorToClick(int row, int col)
+{
+    long line = topLineOfScreen + row;
+    int asciiCol = (bytesPerLine * 2) + (bytesPerLine / bytesPerGroup) + RIGHT_OFFSET + ASCII_OFFSET + 2;
+    int i, x = -1, half = 0;
+
+    for (i = 0; i < bytesPerLine && x < 0; i++)
+    {
+        int byteCol = i * 2 + (i / bytesPerGroup) + RIGHT_OFFSET;
+        if (col == byteCol || col == byteCol + 1)
+        {
+            x = i;
+            half = col - byteCol;
+        }
+    }
+    if (x < 0 && showASCII && col >= asciiCol && col < asciiCol + bytesPerLine) x = col - asciiCol;
+    if (x < 0 || line * bytesPerLine + x >= bufferLength) return;
+
+    curBufPos = line * bytesPerLine + x;
+    curBufPosHalf = mode == MODE_BINARY ? half : 0;
+}
+
+/* How many steps a movement key should take. Auto repeat sends a held key every few tens of milliseconds,
+ * so one that comes back that quickly is being held, and the step doubles every HELD_KEY_RAMP repeats. */
+long keyAcceleration(int c)
+{
+    struct timespec now;
+    long gap, shift;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    gap = (now.tv_sec - lastKeyTime.tv_sec) * 1000 + (now.tv_nsec - lastKeyTime.tv_nsec) / 1000000;
+    if (c == lastKey && gap < HELD_KEY_GAP) keyRepeats++;
+    else keyRepeats = 0;
+    lastKey = c;
+    lastKeyTime = now;
+
+    shift = keyRepeats / HELD_KEY_RAMP;
+    if (shift > HELD_KEY_MAX_SHIFT) shift = HELD_KEY_MAX_SHIFT;
+    return 1L << shift;
+}
+
+/* Cursor and view movement, the same in both modes. Returns 1 if c was one of them. */
+int handleNavigation(int c)
+{
+    MEVENT event;
+    int row, col;
+
+    if (c == KEY_UP) moveEditorCursorLines(-keyAcceleration(c));
+    else if (c == KEY_DOWN) moveEditorCursorLines(keyAcceleration(c));
+    else if (c == KEY_LEFT) moveEditorCursorLeft();
+    else if (c == KEY_RIGHT) moveEditorCursorRight();
+    else if (c == KEY_PPAGE) scrollEditor(-getmaxy(editorWin) * keyAcceleration(c));
+    else if (c == KEY_NPAGE) scrollEditor(getmaxy(editorWin) * keyAcceleration(c));
+    else if (c == KEY_HOME) moveCursorToEdge(0, 0);
+    else if (c == KEY_END) moveCursorToEdge(1, 0);
+    else if (c == keyFileStart && c > 0) moveCursorToEdge(0, 1);
+    else if (c == keyFileEnd && c > 0) moveCursorToEdge(1, 1);
+    else if (c == KEY_MOUSE)
+    {
+        if (getmouse(&event) != OK) return 1;
+        /* the button stands in for the key, so turning the wheel the other way starts slow again*/
+        if (event.bstate & BUTTON4_PRESSED) scrollEditor(-WHEEL_LINES * keyAcceleration(BUTTON4_PRESSED));
+        else if (event.bstate & BUTTON5_PRESSED) scrollEditor(WHEEL_LINES * keyAcceleration(BUTTON5_PRESSED));
+        else if (event.bstate & BUTTON1_PRESSED)
+        {
+            row = event.y;
+            col = event.x;
+            if (wmouse_trafo(editorWin, &row, &col, FALSE)) moveCursorToClick(row, col);
+        }
+    }
+    else return 0;
+    return 1;
 }
 void moveEditorCursorLeft()
 {
@@ -326,12 +1163,12 @@ void moveEditorCursorRight()
     curBufPosHalf = 0;
     curBufPos += 1;
 
-    if (curBufPos >= bufferLength) curBufPos = bufferLength - 1;
+    if (curBufPos >= bufferLength) curBufPos = bufferLength ? bufferLength - 1 : 0;
 }
 
 void moveCursorToScreenPos()
 {
-    int row = (curBufPos - (curBufPos % bytesPerLine)) / bytesPerLine;
+    long row = (curBufPos - (curBufPos % bytesPerLine)) / bytesPerLine;
     int x = (curBufPos - (bytesPerLine * row));
     int col = x * 2 + (x / bytesPerGroup) + curBufPosHalf + RIGHT_OFFSET;
     row = row - topLineOfScreen;
@@ -345,9 +1182,22 @@ void moveCursorToScreenPos()
 
 void handleInput(int c)
 {
+    if (c == KEY_RESIZE)
+    {
+        resizeScreen();
+        return;
+    }
+    if (handleNavigation(c)) return;
+    if (c == KEY_PASTE_BEGIN)
+    {
+        pasteInput();
+        return;
+    }
+    if (c == KEY_PASTE_END) return;
+
     if (mode == MODE_ASCII)
     {
-        if (c == KEY_END)
+        if (c == 27)
         {
             mode = MODE_BINARY;
             sprintf(userOutput, "ASCII mode disabled.");
@@ -355,28 +1205,12 @@ void handleInput(int c)
         else if (c == KEY_BACKSPACE)
         {
             moveEditorCursorLeft();
-            buffer[curBufPos] = 0;
+            setBufferByte(curBufPos, 0);
             bufferModified = 1;
         }
-        else if (c == KEY_RIGHT)
-        {
-            moveEditorCursorRight();
-        }
-        else if (c == KEY_LEFT)
-        {
-            moveEditorCursorLeft();
-        }
-        else if (c == KEY_UP)
-        {
-            moveEditorCursorUp();
-        }
-        else if (c == KEY_DOWN)
-        {
-            moveEditorCursorDown();
-        }
         else
         {
-            buffer[curBufPos] = c;
+            setBufferByte(curBufPos, c);
             moveEditorCursorRight();
             bufferModified = 1;
         }
@@ -384,17 +1218,31 @@ void handleInput(int c)
     else if (mode == MODE_BINARY)
     {
 
-        if (c == 'R')
+        if (c == 'R' && compressedInput)
+        {
+            sprintf(userOutput, "Error: Can't resize a compressed file.");
+        }
+        else if (c == 'R')
         {
             sprintf(userOutput, "Resize Buffer to:");
             inputPopup(userOutput);
+            if (exitSignal) return;
             if (strtol(userInput, NULL, 0) <= 0)
             {
                 sprintf(userOutput, "Error: invalid number");
                 return;
             }
-            resizeBuffer(strtol(userInput, NULL, 0));
-            sprintf(userOutput, "Buffer resized to 0x%lX / %ld", bufferLength, bufferLength);
+            long newSize = strtol(userInput, NULL, 0);
+            if (newSize > bufferLength)
+            {
+                sprintf(userOutput, "Allocate the new space on save? [y/N]");
+                inputPopup(userOutput);
+                if (exitSignal) return;
+                preallocate = userInput[0] == 'y' || userInput[0] == 'Y';
+            }
+            if (resizeBuffer(newSize)) return;
+            sprintf(userOutput, "Buffer resized to 0x%lX / %ld%s", bufferLength, bufferLength,
+                    preallocate ? ", allocated on save" : "");
             bufferModified = 1;
         }
         else if (c == 'G')
@@ -402,18 +1250,23 @@ void handleInput(int c)
 
             sprintf(userOutput, "Goto:");
             inputPopup(userOutput);
+            if (exitSignal) return;
             if (strtol(userInput, NULL, 0) < 0)
             {
                 sprintf(userOutput, "Error: invalid number");
                 return;
             }
-            curBufPos = leastOf(strtol(userInput, NULL, 0), bufferLength - 1);
+            long target = leastOf(strtol(userInput, NULL, 0), bufferLength ? bufferLength - 1 : 0);
+            /* jumps set the read ahead direction the same way scrolling does*/
+            int direction = target < curBufPos ? DIRECTION_BACKWARD : DIRECTION_FORWARD;
+            curBufPos = target;
+            requestPrefetch(direction);
             sprintf(userOutput, "Moved cursor");
         }
         else if (c == 'A')
         {
             mode = MODE_ASCII;
-            sprintf(userOutput, "ASCII mode enabled. Press END to disable.");
+            sprintf(userOutput, "ASCII mode enabled. Press ESC to disable.");
             /* OLD ASCII INSERT CODE
              sprintf(userOutput, "ASCII Insert:");
              inputPopup(userOutput);
@@ -434,6 +1287,7 @@ void handleInput(int c)
             int numberToInsert;
             sprintf(userOutput, "Batch Insert Character Value:");
             inputPopup(userOutput);
+            if (exitSignal) return;
             if (strlen(userInput) == 0)
             {
                 sprintf(userOutput, "Error: Empty string.");
@@ -448,6 +1302,7 @@ void handleInput(int c)
 
             sprintf(userOutput, "Number to Insert:");
             inputPopup(userOutput);
+            if (exitSignal) return;
             if (strlen(userInput) == 0)
             {
                 sprintf(userOutput, "Error: Empty string.");
@@ -459,7 +1314,7 @@ void handleInput(int c)
                 return;
             }
             numberToInsert = strtol(userInput, NULL, 0);
-            memset(&buffer[curBufPos], charToInsert, leastOf(numberToInsert, bufferLength - curBufPos));
+            fillBuffer(curBufPos, charToInsert, leastOf(numberToInsert, bufferLength - curBufPos));
             sprintf(userOutput, "Character 0x%02x inserted", charToInsert);
             bufferModified = 1;
         }
@@ -467,12 +1322,79 @@ void handleInput(int c)
         {
             saveBuffer();
         }
+        else if (c == 'T')
+        {
+            stringsPanel();
+        }
+        else if (c == 'F')
+        {
+            signaturesPanel();
+        }
+        else if (c == '/')
+        {
+            findNext();
+        }
+        else if (c == 'X')
+        {
+            replacePattern();
+        }
+        else if (c == 'L')
+        {
+            detectRecordSize();
+        }
+        else if (c == 'M')
+        {
+            toggleBookmark();
+        }
+        else if (c == 'O')
+        {
+            overlayInput();
+        }
+        else if (c == 'J')
+        {
+            nextBookmark();
+        }
+        else if (c == 'N' || c == 'P')
+        {
+            int direction = c == 'N' ? DIRECTION_FORWARD : DIRECTION_BACKWARD;
+            long target;
+            pthread_mutex_lock(&cacheLock);
+            target = nextDataOffset(curBufPos, direction);
+            pthread_mutex_unlock(&cacheLock);
+            if (target < 0 || target >= bufferLength)
+            {
+                sprintf(userOutput, "No more data %s here.", direction == DIRECTION_FORWARD ? "after" : "before");
+                return;
+            }
+            curBufPos = target;
+            curBufPosHalf = 0;
+            requestPrefetch(direction);
+            sprintf(userOutput, "Moved to data at 0x%lX", curBufPos);
+        }
+        else if (c == 'I')
+        {
+            unsigned long hits, misses, prefetched;
+            pthread_mutex_lock(&cacheLock);
+            hits = cacheHits;
+            misses = cacheMisses;
+            prefetched = cachePrefetched;
+            pthread_mutex_unlock(&cacheLock);
+            sprintf(userOutput, "Cache: %lu hits, %lu misses (%lu%% hit), %lu prefetched", hits, misses,
+                    (hits + misses) ? (hits * 100) / (hits + misses) : 0, prefetched);
+            if (frameCount > 0)
+            {
+                /* the frame that put the last status up, so the one showing this is one behind*/
+                sprintf(userOutput + strlen(userOutput), ". Screen: %luB in %lu write%s, %luB avg",
+                        lastFrameBytes, lastFrameWrites, lastFrameWrites == 1 ? "" : "s", frameBytes / frameCount);
+            }
+        }
         else if (c == 'Q')
         {
             if (bufferModified)
             {
                 sprintf(userOutput, "Buffer is modified. Save? [Y/n]");
                 inputPopup(userOutput);
+                if (exitSignal) return; /* no answer, the main loop leaves the edits in the journal*/
                 if (userInput[0] != 'n' && userInput[0] != 'N')
                 {
                     int ret = saveBuffer();
@@ -482,335 +1404,146 @@ void handleInput(int c)
                         /* basically, do not exit, there was a problem. save buffer will output its own status*/
                     }
                 }
+                else
+                {
+                    /* stop it first so a last autosave doesn't bring the journal back*/
+                    stopJournal();
+                    discardJournal();
+                }
             }
             attemptCleanExit(EXIT_SUCCESS);
         }
-        else if (c == KEY_RIGHT)
+        else if (c >= '0' && c <= '9')
         {
-            moveEditorCursorRight();
+            editNibble(c - '0');
         }
-        else if (c == KEY_LEFT)
+        else if (c >= 'a' && c <= 'f')
         {
-            moveEditorCursorLeft();
+            editNibble(c - 'a' + 0xa);
         }
-        else if (c == KEY_UP)
+    }
+}
+
+/* writes a hex digit into the half of the byte under the cursor, then moves along*/
+void editNibble(int value)
+{
+    unsigned char current = getBufferByte(curBufPos);
+
+    if (curBufPosHalf == 0)
+    {
+        setBufferByte(curBufPos, (current & 0x0f) | (value << 4));
+        curBufPosHalf = 1;
+    }
+    else
+    {
+        setBufferByte(curBufPos, (current & 0xf0) | value);
+        moveEditorCursorRight();
+    }
+    bufferModified = 1;
+}
+
+/* Squeezes the hex digits in text down to the front, dropping whitespace, commas and 0x prefixes.
+ * Returns how many digits are left, or -1 with the offset of the bad character in userOutput. */
+long compactHex(char * text, long len)
+{
+    long from = 0, digits = 0, run;
+
+    while (from < len)
+    {
+        if (isspace((unsigned char) text[from]) || text[from] == ',')
         {
-            moveEditorCursorUp();
+            from++;
+            continue;
         }
-        else if (c == KEY_DOWN)
+        if (text[from] == '0' && from + 1 < len && (text[from + 1] == 'x' || text[from + 1] == 'X'))
         {
-            moveEditorCursorDown();
+            from += 2;
         }
-        else if (c == '0')
+        run = hexRunLength(text + from, len - from);
+        if (run == 0)
         {
-            if (curBufPosHalf == 0)
-            {
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                curBufPosHalf = 1;
-            }
-            else
-            {
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                moveEditorCursorRight();
-            }
-            bufferModified = 1;
-
+            sprintf(userOutput, "Error: Paste isn't hex at character %ld, use ASCII mode for text.", from);
+            return -1;
         }
-        else if (c == '1')
-        {
-            if (curBufPosHalf == 0)
-            {
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] |= 0x10;
-                curBufPosHalf = 1;
-            }
-            else
-            {
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] |= 0x01;
-                moveEditorCursorRight();
-            }
-            bufferModified = 1;
+        memmove(text + digits, text + from, run);
+        digits += run;
+        from += run;
+    }
+    return digits;
+}
 
-        }
-        else if (c == '2')
+/* Takes everything up to the end of a bracketed paste and writes it at the cursor in one go.
+ * Binary mode decodes it as hex, ASCII mode takes the bytes as they are. */
+void pasteInput()
+{
+    char * text = NULL;
+    char * grown;
+    long len = 0, capacity = 0, n;
+    int c, failed = 0;
+
+    timeout(PASTE_TIMEOUT);
+    while ((c = getch()) != ERR && c != KEY_PASTE_END)
+    {
+        if (c > 0xff || failed) continue; /* keep reading so the rest doesn't turn into commands*/
+        if (len == capacity)
         {
-            if (curBufPosHalf == 0)
-            {
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] |= 0x20;
-                curBufPosHalf = 1;
-            }
-            else
+            capacity = capacity ? capacity * 2 : 0x10000;
+            grown = realloc(text, capacity);
+            if (grown == NULL)
             {
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] |= 0x02;
-                moveEditorCursorRight();
+                failed = 1;
+                continue;
             }
-            bufferModified = 1;
-
+            text = grown;
         }
-        else if (c == '3')
-        {
-            if (curBufPosHalf == 0)
-            {
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] |= 0x30;
-                curBufPosHalf = 1;
-            }
-            else
-            {
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] |= 0x03;
-                moveEditorCursorRight();
-            }
-            bufferModified = 1;
-
-        }
-        else if (c == '4')
-        {
-            if (curBufPosHalf == 0)
-            {
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] |= 0x40;
-                curBufPosHalf = 1;
-            }
-            else
-            {
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] |= 0x04;
-                moveEditorCursorRight();
-            }
-            bufferModified = 1;
-
-        }
-        else if (c == '5')
-        {
-            if (curBufPosHalf == 0)
-            {
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] |= 0x50;
-                curBufPosHalf = 1;
-            }
-            else
-            {
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] |= 0x05;
-                moveEditorCursorRight();
-            }
-            bufferModified = 1;
-
-        }
-        else if (c == '6')
-        {
-            if (curBufPosHalf == 0)
-            {
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] |= 0x60;
-                curBufPosHalf = 1;
-            }
-            else
-            {
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] |= 0x06;
-                moveEditorCursorRight();
-            }
-            bufferModified = 1;
-
-        }
-        else if (c == '7')
-        {
-            if (curBufPosHalf == 0)
-            {
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] |= 0x70;
-                curBufPosHalf = 1;
-            }
-            else
-            {
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] |= 0x07;
-                moveEditorCursorRight();
-            }
-            bufferModified = 1;
-
-        }
-        else if (c == '8')
-        {
-            if (curBufPosHalf == 0)
-            {
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] |= 0x80;
-                curBufPosHalf = 1;
-            }
-            else
-            {
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] |= 0x08;
-                moveEditorCursorRight();
-            }
-            bufferModified = 1;
-
-        }
-        else if (c == '9')
-        {
-            if (curBufPosHalf == 0)
-            {
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] |= 0x90;
-                curBufPosHalf = 1;
-            }
-            else
-            {
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] |= 0x09;
-                moveEditorCursorRight();
-            }
-            bufferModified = 1;
-
-        }
-        else if (c == 'a')
-        {
-            if (curBufPosHalf == 0)
-            {
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] |= 0xa0;
-                curBufPosHalf = 1;
-            }
-            else
-            {
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] |= 0x0a;
-                moveEditorCursorRight();
-            }
-            bufferModified = 1;
-
-        }
-        else if (c == 'b')
-        {
-            if (curBufPosHalf == 0)
-            {
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] |= 0xb0;
-                curBufPosHalf = 1;
-            }
-            else
-            {
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] |= 0x0b;
-                moveEditorCursorRight();
-            }
-            bufferModified = 1;
-
-        }
-        else if (c == 'c')
-        {
-            if (curBufPosHalf == 0)
-            {
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] |= 0xc0;
-                curBufPosHalf = 1;
-            }
-            else
-            {
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] |= 0x0c;
-                moveEditorCursorRight();
-            }
-            bufferModified = 1;
-
-        }
-        else if (c == 'd')
-        {
-            if (curBufPosHalf == 0)
-            {
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] |= 0xd0;
-                curBufPosHalf = 1;
-            }
-            else
-            {
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] |= 0x0d;
-                moveEditorCursorRight();
-            }
-            bufferModified = 1;
+        text[len++] = c;
+    }
+    timeout(250);
 
-        }
-        else if (c == 'e')
+    if (failed)
+    {
+        sprintf(userOutput, "Error: Out of memory for the paste.");
+    }
+    else if (len == 0)
+    {
+        sprintf(userOutput, "Nothing pasted.");
+    }
+    else if (mode == MODE_ASCII)
+    {
+        n = leastOf(len, bufferLength - curBufPos);
+        writeBuffer(curBufPos, (unsigned char *) text, n);
+        curBufPos = leastOf(curBufPos + n, bufferLength - 1);
+        bufferModified = 1;
+        sprintf(userOutput, "Pasted %ld bytes%s", n, n < len ? ", the rest ran past the end" : "");
+    }
+    else if ((n = compactHex(text, len)) >= 0)
+    {
+        if (n % 2 != 0)
         {
-            if (curBufPosHalf == 0)
-            {
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] |= 0xe0;
-                curBufPosHalf = 1;
-            }
-            else
-            {
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] |= 0x0e;
-                moveEditorCursorRight();
-            }
-            bufferModified = 1;
-
+            sprintf(userOutput, "Error: Paste has an odd number of hex digits.");
         }
-        else if (c == 'f')
+        else
         {
-            if (curBufPosHalf == 0)
-            {
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] |= 0xf0;
-                curBufPosHalf = 1;
-            }
-            else
-            {
-                buffer[curBufPos] = buffer[curBufPos] >> 4;
-                buffer[curBufPos] = buffer[curBufPos] << 4;
-                buffer[curBufPos] |= 0x0f;
-                moveEditorCursorRight();
-            }
+            /* decoding in place is fine, each byte lands before the digits it came from*/
+            n /= 2;
+            decodeHex(text, n, (unsigned char *) text);
+            len = n;
+            n = leastOf(n, bufferLength - curBufPos);
+            writeBuffer(curBufPos, (unsigned char *) text, n);
+            curBufPos = leastOf(curBufPos + n, bufferLength - 1);
+            curBufPosHalf = 0;
             bufferModified = 1;
-
+            sprintf(userOutput, "Pasted %ld bytes%s", n, n < len ? ", the rest ran past the end" : "");
         }
     }
+    free(text);
 }
 
-void drawASCII(int line)
+void drawASCII(long line, unsigned char * lineBytes)
 {
     int displayRow = line - topLineOfScreen;
     int displayCol = (bytesPerLine * 2) + (bytesPerLine / bytesPerGroup) + RIGHT_OFFSET + ASCII_OFFSET;
-    int i;
+    long i;
 
     if (!showASCII) return;
 
@@ -818,17 +1551,19 @@ void drawASCII(int line)
     wprintw(editorWin, "%c ", SEPARATOR);
     for (i = line * bytesPerLine; i < (line + 1) * bytesPerLine; i++)
     {
+        unsigned char byte;
         if (i >= bufferLength)
         {
             break;
         }
+        byte = lineBytes[i - line * bytesPerLine];
 
         if (i == curBufPos) wattron(editorWin, A_REVERSE);
 
         /*check to see if its a printable ASCII char*/
-        if (buffer[i] >= 0x20 && buffer[i] <= 0x7E)
+        if (byte >= 0x20 && byte <= 0x7E)
         {
-            wprintw(editorWin, "%c", buffer[i]);
+            wprintw(editorWin, "%c", byte);
         }
         else
         {
@@ -841,15 +1576,60 @@ void drawASCII(int line)
 /* draw the screen, which is updated with every change. Does not include the border*/
 void drawEditorWin()
 {
-    int n, rows, startByte, endByte;
+    int rows;
+    long n, startByte, endByte;
+    unsigned char * screenBytes;
+    char * inHole;
+    char * inHit;
+    unsigned long overlayEnd = overlayStart;
+    int i, fieldAttr;
     handleScrolling();
 
     werase(editorWin);/*difference between clear and erase is that clear calls refresh directly after. With lots of keypresses you get flicker. Hence, erase. */
     wmove(editorWin, 0, 0);
-    getmaxyx(editorWin, rows, n);
+    rows = getmaxy(editorWin);
     startByte = topLineOfScreen * bytesPerLine; /* first byte on the top displayed line*/
     endByte = leastOf(bufferLength, startByte + (rows * bytesPerLine)); /* last byte to be displayed. Basically startByte + total Number of bytes that can be displayed*/
 
+    /* pull the whole screen out of the cache in one go rather than byte by byte*/
+    screenBytes = malloc(endByte - startByte + 1);
+    inHole = calloc(1, endByte - startByte + 1);
+    inHit = calloc(1, endByte - startByte + 1);
+    if (screenBytes == NULL || inHole == NULL || inHit == NULL)
+    {
+        free(screenBytes);
+        free(inHole);
+        free(inHit);
+        return;
+    }
+    readBuffer(startByte, screenBytes, endByte - startByte);
+
+    /* work out which bytes on screen are holes, so they can be dimmed*/
+    pthread_mutex_lock(&cacheLock);
+    if (holesMapped && endByte > startByte)
+    {
+        memset(inHole, 1, endByte - startByte);
+        for (i = findExtent(startByte); i < dataExtentCount && dataExtents[i].start < endByte; i++)
+        {
+            long from = dataExtents[i].start > startByte ? dataExtents[i].start : startByte;
+            memset(inHole + from - startByte, 0, leastOf(dataExtents[i].end, endByte) - from);
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+    markHits(startByte, endByte, inHit);
+    if (matchOffset >= 0 && matchOffset < endByte && matchOffset + matchLength > startByte)
+    {
+        long from = matchOffset > startByte ? matchOffset : startByte;
+        memset(inHit + from - startByte, 1, leastOf(matchOffset + matchLength, endByte) - from);
+    }
+    /* bookmarks are marked 2 and shown reversed, over any hit*/
+    for (i = 0; i < bookmarkCount; i++)
+    {
+        if (bookmarks[i] >= startByte && bookmarks[i] < endByte) inHit[bookmarks[i] - startByte] = 2;
+    }
+
+    if (overlayWin != NULL) overlayEnd = overlayStart + overlayRecordCount() * templateSize;
+
     for (n = startByte; n < endByte; n++)
     {
         if (n % bytesPerLine == 0)
@@ -857,7 +1637,7 @@ void drawEditorWin()
             /* print the line header */
             if (n != startByte) wprintw(editorWin, "\n");
             wattron(editorWin, A_BOLD);
-            wprintw(editorWin, "0x%08X", n);
+            wprintw(editorWin, "0x%0*lX", offsetDigits(), n);
             wattroff(editorWin, A_BOLD);
             wprintw(editorWin, " %c ", SEPARATOR);
         }
@@ -866,17 +1646,44 @@ void drawEditorWin()
             /*add a space between groups of bytes*/
             wprintw(editorWin, " ");
         }
-        wprintw(editorWin, "%02x", buffer[n]);
+        /* the overlay's field colour goes under whatever else the byte is marked with*/
+        fieldAttr = n >= overlayStart && n < overlayEnd ? overlayAttr(templateFieldAt[(n - overlayStart) % templateSize]) : A_NORMAL;
+        wattron(editorWin, fieldAttr);
+        if (inHit[n - startByte] == 2)
+        {
+            wattron(editorWin, A_REVERSE);
+            wprintw(editorWin, "%02x", screenBytes[n - startByte]);
+            wattroff(editorWin, A_REVERSE);
+        }
+        else if (inHit[n - startByte])
+        {
+            wattron(editorWin, A_UNDERLINE | A_BOLD);
+            wprintw(editorWin, "%02x", screenBytes[n - startByte]);
+            wattroff(editorWin, A_UNDERLINE | A_BOLD);
+        }
+        /* zeros that are still a hole on disk, an edit there shows up normally*/
+        else if (inHole[n - startByte] && screenBytes[n - startByte] == 0)
+        {
+            wattron(editorWin, A_DIM);
+            wprintw(editorWin, "%02x", 0);
+            wattroff(editorWin, A_DIM);
+        }
+        else wprintw(editorWin, "%02x", screenBytes[n - startByte]);
+        wattroff(editorWin, fieldAttr);
 
         /*if it's the end of a line, or if it's the last char, then show the ASCII representation*/
         if ((n + 1) % bytesPerLine == 0 || n == endByte - 1)
         {
-            drawASCII((n - (n % bytesPerLine)) / bytesPerLine);
+            long line = (n - (n % bytesPerLine)) / bytesPerLine;
+            drawASCII(line, &screenBytes[line * bytesPerLine - startByte]);
         }
     }
+    free(screenBytes);
+    free(inHole);
+    free(inHit);
 
     moveCursorToScreenPos();
-    wrefresh(editorWin);
+    wnoutrefresh(editorWin);
 }
 
 void drawUserWin()
@@ -885,17 +1692,31 @@ void drawUserWin()
     wmove(userWin, 0, 0);
     wattron(userWin, A_REVERSE);
     wborder(userWin, ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ');
-    wprintw(userWin, "Position: 0x%X / %d of 0x%X / %d bytes", curBufPos, curBufPos, bufferLength, bufferLength);
+    wprintw(userWin, "Position: 0x%lX / %ld of 0x%lX / %ld bytes", curBufPos, curBufPos, bufferLength, bufferLength);
+    if (compressedInput)
+    {
+        pthread_mutex_lock(&gzIndexLock);
+        if (gzIndexState == 0) wprintw(userWin, " (gzip, indexing %lu%%)", gzFileSize ? gzIndexedInput * 100 / gzFileSize : 0);
+        else if (gzIndexState < 0) wprintw(userWin, " (gzip, damaged past here)");
+        else wprintw(userWin, " (gzip)");
+        pthread_mutex_unlock(&gzIndexLock);
+    }
+    pthread_mutex_lock(&cacheLock);
+    if (holesMapped && bufferLength > 0 && (dataExtentCount != 1 || dataExtents[0].start != 0 || dataExtents[0].end != backingLength))
+    {
+        wprintw(userWin, " (sparse, %d extents%s)", dataExtentCount, rangeIsHole(curBufPos, 1) ? ", in a hole" : "");
+    }
+    pthread_mutex_unlock(&cacheLock);
     wmove(userWin, 1, 0);
     wprintw(userWin, "Status  : %s", userOutput);
     wattroff(userWin, A_REVERSE);
-    wrefresh(userWin);
+    wnoutrefresh(userWin);
 }
 
 /* the border, which does not update and will only be drawn once*/
 void drawBorderWin()
 {
-    char temp[255];
+    char temp[BUFFER_LENGTH + 32]; /* room for the whole filename after the name and version*/
     int y, x;
     getmaxyx(borderWin, y, x);
     erase();
@@ -904,48 +1725,47 @@ void drawBorderWin()
     wborder(borderWin, ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ');
 
     wmove(borderWin, 0, 3);
-    sprintf(temp, "%s v%s - %s", PROG_NAME, VERSION, filename);
-    wprintw(borderWin, temp);
+    snprintf(temp, sizeof(temp), "%s v%s - %s", PROG_NAME, VERSION, filename);
+    wprintw(borderWin, "%s", temp);
 
     move(y - 1, 1);
     y = x;/*this is literally only so the warning about not using x will stop popping up*/
-    printw("Commands: 'Q'uit 'S'ave 'G'oto 'R'esize 'A'scii_mode 'B'atch_insert");
+    printw("Commands: 'Q'uit 'S'ave 'G'oto 'R'esize 'A'scii_mode 'B'atch_insert 'I'nfo '/'find 'X'_replace 'T'ext_strings 'F'ind_signatures 'N'ext/'P'rev_data 'M'ark/'J'ump 'O'verlay");
 
     attroff(A_REVERSE);
-    refresh();
+    wnoutrefresh(stdscr);
+}
+
+/* hex digits needed for the last offset in the buffer, so the columns stay put on very large files */
+int offsetDigits()
+{
+    int digits = OFFSET_DIGITS;
+    while (digits < 16 && bufferLength > 1 && ((bufferLength - 1) >> (digits * 4)) != 0) digits++;
+    return digits;
 }
 
 /*returns the lesser of two numbers*/
-int leastOf(int x, int y)
+long leastOf(long x, long y)
 {
     if (x > y) return y;
     return x;
 }
 
+/* brings the cursor back on screen by setting topLineOfScreen straight away, however far it has jumped*/
 void handleScrolling()
 {
-    int done = 0;
-    int rows, startByte, endByte;
-    /*Scroll until we get to see the cursor again. Used for Gotos*/
-    while (!done)
-    {
-        startByte = topLineOfScreen * bytesPerLine; /* first byte on the top displayed line*/
-        getmaxyx(editorWin, rows, endByte);
-        endByte = leastOf(bufferLength, startByte + (rows * bytesPerLine)); /* last byte to be displayed. Basically startByte + total Number of bytes that can be displayed*/
-
-        if (curBufPos < startByte)
-        {
-            topLineOfScreen--;
+    long rows, cursorLine;
+    if (bufferLength == 0) return; /* nothing to scroll to yet, still decompressing*/
 
-        }
-        else if (curBufPos >= endByte)
-        {
-            topLineOfScreen++;
-        }
-        else
-        {
-            done = 1;
-        }
+    rows = getmaxy(editorWin);
+    cursorLine = curBufPos / bytesPerLine;
+    if (cursorLine < topLineOfScreen)
+    {
+        topLineOfScreen = cursorLine;
+    }
+    else if (cursorLine >= topLineOfScreen + rows)
+    {
+        topLineOfScreen = cursorLine - rows + 1;
     }
 }
 
@@ -970,31 +1790,4530 @@ void inputPopup(char * title)
     wrefresh(popupWin);
 
     echo();
+    timeout(-1); /* the main loop's wake up timer would cut the typing short*/
     getnstr(userInput, POPUP_WIDTH - 2);
+    if (exitSignal) userInput[0] = 0; /* cut short, nothing was really entered*/
+    timeout(250);
     noecho();
+    delwin(popupWin);
+    popupWin = NULL;
 }
 
+/* Writes the edits back into the file in place. Only chunks that were changed get written. Growth is
+ * left as a hole, and zeros written over a hole stay a hole, so sparse files stay sparse. */
 int saveBuffer()
 {
-    if (fp != NULL){
-	//sprintf(userOutput, "Error: File still open.");
-	//return -1;
-	fclose(fp);
-        fp = NULL;
+    int i, outFd;
+    struct stat fileStat;
+    unsigned long pos;
+
+    if (compressedInput) return saveDecompressed();
+
+    outFd = open(filename, O_WRONLY | O_CREAT, 0644);
+    if (outFd < 0 || fstat(outFd, &fileStat) != 0)
+    {
+        if (outFd >= 0) close(outFd);
+        sprintf(userOutput, "Error: Couldn't save to %.200s", filename);
+        return -1;
     }
-    fp = fopen(filename, "w+");
-    if (fp == NULL)
+
+    pthread_mutex_lock(&cacheLock);
+    /* anything on disk past backingLength is stale, so cut it off before growing again*/
+    if (fileStat.st_size > backingLength && ftruncate(outFd, backingLength) != 0)
+    {
+        pthread_mutex_unlock(&cacheLock);
+        close(outFd);
+        sprintf(userOutput, "Error: Couldn't truncate %.200s", filename);
+        return -1;
+    }
+    /* growing is a length change, unless the space was asked for up front. Filesystems that can't
+     * allocate get a hole instead*/
+    if (bufferLength > backingLength && preallocate
+        && fallocate(outFd, 0, backingLength, bufferLength - backingLength) == 0)
+    {
+        preallocate = 0;
+    }
+    if (bufferLength > backingLength && ftruncate(outFd, bufferLength) != 0)
     {
-        sprintf(userOutput, "Error: Couldn't save to %s", filename);
+        pthread_mutex_unlock(&cacheLock);
+        close(outFd);
+        sprintf(userOutput, "Error: Couldn't grow %.200s", filename);
         return -1;
     }
-    fseek(fp, 0, SEEK_SET); /* go to beginning of file*/
-    fwrite(buffer, sizeof(unsigned char), bufferLength, fp);
-    fclose(fp);
-    fp = NULL;
+    for (i = 0; i < dirtyChunkCount; i++)
+    {
+        pos = dirtyChunks[i].index * CHUNK_SIZE;
+        if (writeSparse(outFd, dirtyChunks[i].data, leastOf(CHUNK_SIZE, bufferLength - pos), pos, 1)) break;
+    }
+    if (i < dirtyChunkCount || close(outFd) != 0)
+    {
+        if (i < dirtyChunkCount) close(outFd);
+        pthread_mutex_unlock(&cacheLock);
+        sprintf(userOutput, "Error: Couldn't save to %.200s", filename);
+        return -1;
+    }
+
+    /* the file now matches the buffer, so the edits can go and the cache starts over*/
+    for (i = 0; i < dirtyChunkCount; i++)
+    {
+        free(dirtyChunks[i].data);
+    }
+    dirtyChunkCount = 0;
+    backingLength = bufferLength;
+    invalidateChunkCache();
+    pthread_mutex_unlock(&cacheLock);
+
+    if (fp == NULL)
+    {
+        /* a new file, from here on the cache can read it back*/
+        fp = fopen(filename, "r");
+    }
+    if (fp != NULL) mapHoles();
+    discardJournal(); /* everything in it is in the file now*/
     bufferModified = 0;
-    sprintf(userOutput, "Buffer saved to %s", filename);
+    sprintf(userOutput, "Buffer saved to %.200s%s", filename, preallocate ? ", couldn't allocate the new space" : "");
+    preallocate = 0;
+    return 0;
+}
+
+/* Sets up the empty cache and starts the read ahead thread. */
+int initChunkCache()
+{
+    int i;
+    for (i = 0; i < CACHE_SLOTS; i++)
+    {
+        chunkCache[i].index = -1;
+        chunkCache[i].data = NULL;
+        chunkCache[i].lastUsed = 0;
+    }
+    prefetchRunning = 1;
+    if (pthread_create(&prefetchThread, NULL, prefetchWorker, NULL) != 0)
+    {
+        prefetchRunning = 0;
+        return -1;
+    }
     return 0;
+}
+
+void stopChunkCache()
+{
+    int i;
+    if (!prefetchRunning) return;
+
+    pthread_mutex_lock(&cacheLock);
+    prefetchRunning = 0;
+    pthread_cond_signal(&prefetchCond);
+    pthread_mutex_unlock(&cacheLock);
+    pthread_join(prefetchThread, NULL);
+
+    for (i = 0; i < CACHE_SLOTS; i++)
+    {
+        free(chunkCache[i].data);
+        chunkCache[i].data = NULL;
+    }
+    for (i = 0; i < dirtyChunkCount; i++)
+    {
+        free(dirtyChunks[i].data);
+    }
+    free(dirtyChunks);
+    dirtyChunks = NULL;
+    dirtyChunkCount = 0;
+}
+
+/* Reads one chunk from the file into dest. Whatever is past backingLength comes back as zeros.
+ * Does the IO without holding cacheLock, so callers pass in a snapshot of backingLength's chunk. */
+int loadChunk(long index, unsigned char * dest)
+{
+    unsigned long start = index * CHUNK_SIZE;
+    unsigned long wanted = 0;
+    unsigned long got = 0;
+    ssize_t ret;
+
+    pthread_mutex_lock(&cacheLock);
+    if (start < backingLength) wanted = leastOf(CHUNK_SIZE, backingLength - start);
+    if (rangeIsHole(start, wanted)) wanted = 0; /* nothing on disk to read*/
+    pthread_mutex_unlock(&cacheLock);
+
+    if (compressedInput && wanted > 0)
+    {
+        got = readCompressed(start, dest, wanted) ? 0 : wanted;
+        memset(dest + got, 0, CHUNK_SIZE - got);
+        return got == wanted ? 0 : -1;
+    }
+    while (fp != NULL && got < wanted)
+    {
+        ret = pread(fileno(fp), dest + got, wanted - got, start + got);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) break;
+        got += ret;
+    }
+    memset(dest + got, 0, CHUNK_SIZE - got);
+    return got == wanted ? 0 : -1;
+}
+
+/* Puts a freshly read chunk into the least recently used slot. Takes ownership of data.
+ * Must hold cacheLock. Reads that raced with a save are thrown away. */
+void installChunk(long index, unsigned char * data, unsigned long generation)
+{
+    int i, victim = 0;
+
+    if (generation != cacheGeneration)
+    {
+        free(data);
+        return;
+    }
+    for (i = 0; i < CACHE_SLOTS; i++)
+    {
+        if (chunkCache[i].index == index)
+        {
+            /* someone else got here first*/
+            chunkCache[i].lastUsed = ++cacheClock;
+            free(data);
+            return;
+        }
+        if (chunkCache[i].index == -1)
+        {
+            victim = i;
+            break;
+        }
+        if (chunkCache[i].lastUsed < chunkCache[victim].lastUsed) victim = i;
+    }
+    free(chunkCache[victim].data);
+    chunkCache[victim].index = index;
+    chunkCache[victim].data = data;
+    chunkCache[victim].lastUsed = ++cacheClock;
+}
+
+/* Empties the cache after the file has changed under it. Must hold cacheLock. */
+void invalidateChunkCache()
+{
+    int i;
+    for (i = 0; i < CACHE_SLOTS; i++)
+    {
+        chunkCache[i].index = -1;
+    }
+    cacheGeneration++;
+}
+
+/* Binary search of the edited chunks. Must hold cacheLock. */
+DirtyChunk * findDirtyChunk(long index)
+{
+    int low = 0, high = dirtyChunkCount - 1, mid;
+    while (low <= high)
+    {
+        mid = (low + high) / 2;
+        if (dirtyChunks[mid].index == index) return &dirtyChunks[mid];
+        if (dirtyChunks[mid].index < index) low = mid + 1;
+        else high = mid - 1;
+    }
+    return NULL;
+}
+
+/* Returns the editable copy of a chunk, pulling it out of the file the first time. Must not hold cacheLock. */
+DirtyChunk * getDirtyChunk(long index)
+{
+    DirtyChunk * chunk;
+    unsigned char * data;
+    int i;
+
+    pthread_mutex_lock(&cacheLock);
+    chunk = findDirtyChunk(index);
+    pthread_mutex_unlock(&cacheLock);
+    if (chunk != NULL) return chunk;
 
+    data = malloc(CHUNK_SIZE);
+    if (data == NULL) return NULL;
+    readBuffer(index * CHUNK_SIZE, data, CHUNK_SIZE);
+
+    pthread_mutex_lock(&cacheLock);
+    if (dirtyChunkCount == dirtyChunkCapacity)
+    {
+        int newCapacity = dirtyChunkCapacity ? dirtyChunkCapacity * 2 : 16;
+        DirtyChunk * grown = realloc(dirtyChunks, sizeof(DirtyChunk) * newCapacity);
+        if (grown == NULL)
+        {
+            pthread_mutex_unlock(&cacheLock);
+            free(data);
+            return NULL;
+        }
+        dirtyChunks = grown;
+        dirtyChunkCapacity = newCapacity;
+    }
+    /* keep it sorted*/
+    for (i = dirtyChunkCount; i > 0 && dirtyChunks[i - 1].index > index; i--)
+    {
+        dirtyChunks[i] = dirtyChunks[i - 1];
+    }
+    dirtyChunks[i].index = index;
+    dirtyChunks[i].data = data;
+    dirtyChunkCount++;
+    chunk = &dirtyChunks[i];
+    pthread_mutex_unlock(&cacheLock);
+    return chunk;
 }
 
+/* Copies len bytes of the buffer starting at pos into dest, through the edits and the cache.
+ * Only blocks on the disk for chunks the prefetcher hasn't got to yet. Returns bytes copied.
+ * Chunks read from disk go into the cache when keep is set, background scans leave it alone. */
+unsigned long copyBuffer(unsigned long pos, unsigned char * dest, unsigned long len, int keep)
+{
+    unsigned long done = 0;
+
+    if (pos >= bufferLength) return 0;
+    len = leastOf(len, bufferLength - pos);
+
+    while (done < len)
+    {
+        long index = (pos + done) / CHUNK_SIZE;
+        int offset = (pos + done) % CHUNK_SIZE;
+        int count = leastOf(CHUNK_SIZE - offset, len - done);
+        unsigned char * source = NULL;
+        DirtyChunk * dirty;
+        int i;
+
+        pthread_mutex_lock(&cacheLock);
+        dirty = findDirtyChunk(index);
+        if (dirty != NULL)
+        {
+            source = dirty->data;
+        }
+        else
+        {
+            for (i = 0; i < CACHE_SLOTS; i++)
+            {
+                if (chunkCache[i].index == index)
+                {
+                    if (keep)
+                    {
+                        chunkCache[i].lastUsed = ++cacheClock;
+                        cacheHits++;
+                    }
+                    source = chunkCache[i].data;
+                    break;
+                }
+            }
+        }
+        if (source != NULL)
+        {
+            memcpy(dest + done, source + offset, count);
+            pthread_mutex_unlock(&cacheLock);
+        }
+        else
+        {
+            unsigned long generation = cacheGeneration;
+            unsigned char * data;
+            if (keep) cacheMisses++;
+            pthread_mutex_unlock(&cacheLock);
+
+            data = malloc(CHUNK_SIZE);
+            if (data == NULL) break;
+            loadChunk(index, data);
+            memcpy(dest + done, data + offset, count);
+
+            if (keep)
+            {
+                pthread_mutex_lock(&cacheLock);
+                installChunk(index, data, generation);
+                pthread_mutex_unlock(&cacheLock);
+            }
+            else free(data);
+        }
+        done += count;
+    }
+    return done;
+}
+
+unsigned long readBuffer(unsigned long pos, unsigned char * dest, unsigned long len)
+{
+    return copyBuffer(pos, dest, len, 1);
+}
+
+unsigned long peekBuffer(unsigned long pos, unsigned char * dest, unsigned long len)
+{
+    return copyBuffer(pos, dest, len, 0);
+}
+
+unsigned char getBufferByte(unsigned long pos)
+{
+    unsigned char value = 0;
+    readBuffer(pos, &value, 1);
+    return value;
+}
+
+void setBufferByte(unsigned long pos, unsigned char value)
+{
+    DirtyChunk * chunk;
+    if (pos >= bufferLength) return;
+
+    chunk = getDirtyChunk(pos / CHUNK_SIZE);
+    if (chunk == NULL) return;
+    pthread_mutex_lock(&cacheLock);
+    chunk->data[pos % CHUNK_SIZE] = value;
+    pthread_mutex_unlock(&cacheLock);
+    markStringsStale(pos, 1);
+    markSignaturesStale(pos, 1);
+    journalEdit(pos, 1, 0);
+}
+
+void fillBuffer(unsigned long pos, unsigned char value, unsigned long len)
+{
+    DirtyChunk * chunk;
+    unsigned long count;
+    unsigned long start = pos;
+
+    len = leastOf(len, bufferLength - pos);
+    while (len > 0)
+    {
+        chunk = getDirtyChunk(pos / CHUNK_SIZE);
+        if (chunk == NULL) return;
+        count = leastOf(CHUNK_SIZE - (pos % CHUNK_SIZE), len);
+        pthread_mutex_lock(&cacheLock);
+        memset(chunk->data + (pos % CHUNK_SIZE), value, count);
+        pthread_mutex_unlock(&cacheLock);
+        pos += count;
+        len -= count;
+    }
+    markStringsStale(start, pos - start);
+    markSignaturesStale(start, pos - start);
+    journalEdit(start, pos - start, 0);
+}
+
+/* Tells the read ahead thread where the cursor is and which way it's heading. */
+void requestPrefetch(int direction)
+{
+    pthread_mutex_lock(&cacheLock);
+    prefetchTarget = curBufPos / CHUNK_SIZE;
+    prefetchDirection = direction;
+    pthread_cond_signal(&prefetchCond);
+    pthread_mutex_unlock(&cacheLock);
+}
+
+/* Background thread that keeps PREFETCH_DEPTH chunks ahead of the cursor loaded, in the direction
+ * it was last moving. Starts over whenever the cursor moves somewhere new. */
+void * prefetchWorker(void * arg)
+{
+    long target, index;
+    int direction, depth, cached, i;
+    unsigned long generation;
+    unsigned char * data;
+
+    pthread_mutex_lock(&cacheLock);
+    while (prefetchRunning)
+    {
+        target = prefetchTarget;
+        direction = prefetchDirection;
+
+        for (depth = 0; depth <= PREFETCH_DEPTH && prefetchRunning; depth++)
+        {
+            /* the chunk under the cursor first, then the ones it's heading towards*/
+            index = target + depth * direction;
+            if (index < 0 || index * CHUNK_SIZE >= bufferLength) break;
+            if (target != prefetchTarget || direction != prefetchDirection) break;
+
+            cached = findDirtyChunk(index) != NULL;
+            for (i = 0; i < CACHE_SLOTS && !cached; i++)
+            {
+                cached = chunkCache[i].index == index;
+            }
+            if (cached) continue;
+
+            generation = cacheGeneration;
+            pthread_mutex_unlock(&cacheLock);
+            data = malloc(CHUNK_SIZE);
+            if (data != NULL) loadChunk(index, data);
+            pthread_mutex_lock(&cacheLock);
+            if (data == NULL) break;
+            installChunk(index, data, generation);
+            cachePrefetched++;
+        }
+
+        /* sleep until the cursor moves again*/
+        while (prefetchRunning && target == prefetchTarget && direction == prefetchDirection)
+        {
+            pthread_cond_wait(&prefetchCond, &cacheLock);
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return arg;
+}
+
+/* Builds the list of data extents with SEEK_DATA/SEEK_HOLE. Filesystems without them get one extent
+ * covering the whole file. Returns -1 on error. */
+int mapHoles()
+{
+    DataExtent * extents = NULL;
+    int count = 0, capacity = 0;
+    off_t data, hole = 0;
+    unsigned long length;
+    int fd = fileno(fp);
+
+    pthread_mutex_lock(&cacheLock);
+    length = backingLength;
+    pthread_mutex_unlock(&cacheLock);
+
+    while (hole < length)
+    {
+#ifdef SEEK_DATA
+        data = lseek(fd, hole, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) break; /* only a hole left*/
+#else
+        data = -1;
+#endif
+        if (data < 0)
+        {
+            /* not supported here, treat it all as data*/
+            count = 0;
+            data = 0;
+            hole = length;
+        }
+        else
+        {
+#ifdef SEEK_HOLE
+            hole = lseek(fd, data, SEEK_HOLE);
+#endif
+            if (hole < 0 || hole > length) hole = length;
+        }
+        if (data >= length) break;
+        if (count == capacity)
+        {
+            int newCapacity = capacity ? capacity * 2 : 16;
+            DataExtent * grown = realloc(extents, sizeof(DataExtent) * newCapacity);
+            if (grown == NULL)
+            {
+                free(extents);
+                return -1;
+            }
+            extents = grown;
+            capacity = newCapacity;
+        }
+        extents[count].start = data;
+        extents[count].end = hole;
+        count++;
+    }
+
+    pthread_mutex_lock(&cacheLock);
+    free(dataExtents);
+    dataExtents = extents;
+    dataExtentCount = count;
+    holesMapped = 1;
+    pthread_mutex_unlock(&cacheLock);
+    return 0;
+}
+
+/* Binary search for the first extent that ends after pos. Must hold cacheLock. */
+int findExtent(unsigned long pos)
+{
+    int low = 0, high = dataExtentCount;
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (dataExtents[mid].end <= pos) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+/* True if nothing in [start, start + len) is backed by data on disk. Must hold cacheLock. */
+int rangeIsHole(unsigned long start, unsigned long len)
+{
+    int i;
+    if (start >= backingLength) return 1;
+    if (!holesMapped) return 0;
+    i = findExtent(start);
+    return i == dataExtentCount || dataExtents[i].start >= start + len;
+}
+
+/* Where the next (or previous) stretch of data starts, skipping any hole in between. -1 if there isn't one.
+ * Must hold cacheLock. */
+long nextDataOffset(unsigned long pos, int direction)
+{
+    int i;
+    if (!holesMapped) return -1;
+    i = findExtent(pos);
+    if (direction == DIRECTION_FORWARD)
+    {
+        if (i < dataExtentCount && dataExtents[i].start <= pos) i++;
+        return i < dataExtentCount ? dataExtents[i].start : -1;
+    }
+    if (i < dataExtentCount && dataExtents[i].start < pos) return dataExtents[i].start;
+    return i > 0 ? dataExtents[i - 1].start : -1;
+}
+
+int isZeroBlock(const unsigned char * data, unsigned long len)
+{
+    return len == 0 || (data[0] == 0 && memcmp(data, data + 1, len - 1) == 0);
+}
+
+/* Writes len bytes at pos, skipping any SPARSE_BLOCK of zeros that can be left as a hole. With checkHoles
+ * that means ones already a hole on disk (must hold cacheLock), without it the file is fresh and every one can.
+ * Returns 0, or -1 on error. */
+int writeSparse(int fd, const unsigned char * data, unsigned long len, unsigned long pos, int checkHoles)
+{
+    unsigned long done = 0, runStart = 0;
+    int inRun = 0;
+
+    while (done <= len)
+    {
+        /* blocks line up with the file so they match the filesystem's*/
+        unsigned long count = leastOf(SPARSE_BLOCK - ((pos + done) % SPARSE_BLOCK), len - done);
+        int skip = done == len || (isZeroBlock(data + done, count) && (!checkHoles || rangeIsHole(pos + done, count)));
+
+        if (skip && inRun)
+        {
+            unsigned long written = 0;
+            while (written < done - runStart)
+            {
+                ssize_t ret = pwrite(fd, data + runStart + written, done - runStart - written, pos + runStart + written);
+                if (ret < 0 && errno == EINTR) continue;
+                if (ret <= 0) return -1;
+                written += ret;
+            }
+            inRun = 0;
+        }
+        else if (!skip && !inRun)
+        {
+            runStart = done;
+            inRun = 1;
+        }
+        if (done == len) break;
+        done += count;
+    }
+    return 0;
+}
+
+/* Checks the start of the file for a compression header. gzip gets indexed in the background,
+ * anything else we recognise but can't seek through is shown raw. Returns -1 on error. */
+int openCompressed()
+{
+    unsigned char magic[6] = {0};
+
+    if (pread(fileno(fp), magic, sizeof(magic), 0) < 2) return 0;
+    if ((magic[0] == 0xfd && memcmp(magic + 1, "7zXZ", 4) == 0) || (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd))
+    {
+        sprintf(userOutput, "xz and zstd can't be decompressed here, showing the raw file.");
+        return 0;
+    }
+    if (magic[0] != 0x1f || magic[1] != 0x8b) return 0;
+
+    compressedInput = 1;
+    gzFileSize = bufferLength;
+    bufferLength = 0;
+    backingLength = 0;
+    gzIndexRunning = 1;
+    if (pthread_create(&gzIndexThread, NULL, gzIndexWorker, NULL) != 0)
+    {
+        gzIndexRunning = 0;
+        return -1;
+    }
+    sprintf(userOutput, "Showing decompressed gzip data. Saving writes an uncompressed copy.");
+    return 0;
+}
+
+void closeCompressed()
+{
+    int i;
+    if (!compressedInput) return;
+
+    pthread_mutex_lock(&gzIndexLock);
+    gzIndexRunning = 0;
+    pthread_mutex_unlock(&gzIndexLock);
+    pthread_join(gzIndexThread, NULL);
+
+    for (i = 0; i < gzCheckpointCount; i++)
+    {
+        free(gzCheckpoints[i].window);
+    }
+    free(gzCheckpoints);
+    gzCheckpoints = NULL;
+    gzCheckpointCount = 0;
+    if (gzReaderValid) inflateEnd(&gzReader);
+    gzReaderValid = 0;
+    compressedInput = 0;
+}
+
+/* Called from the main loop to grow the buffer as the indexer gets further through the file. */
+void pollCompressed()
+{
+    unsigned long indexed;
+    if (!compressedInput) return;
+
+    pthread_mutex_lock(&gzIndexLock);
+    indexed = gzIndexedLength;
+    pthread_mutex_unlock(&gzIndexLock);
+
+    if (indexed == bufferLength) return;
+    pthread_mutex_lock(&cacheLock);
+    bufferLength = indexed;
+    backingLength = indexed;
+    pthread_mutex_unlock(&cacheLock);
+}
+
+/* Records a checkpoint. left is how much of the circular window hasn't been written yet. Must hold gzIndexLock. */
+int addGzCheckpoint(int bits, unsigned long in, unsigned long out, unsigned left, unsigned char * window)
+{
+    GzCheckpoint * point;
+
+    if (gzCheckpointCount == gzCheckpointCapacity)
+    {
+        int newCapacity = gzCheckpointCapacity ? gzCheckpointCapacity * 2 : 64;
+        GzCheckpoint * grown = realloc(gzCheckpoints, sizeof(GzCheckpoint) * newCapacity);
+        if (grown == NULL) return -1;
+        gzCheckpoints = grown;
+        gzCheckpointCapacity = newCapacity;
+    }
+    point = &gzCheckpoints[gzCheckpointCount];
+    point->window = malloc(GZ_WINDOW_SIZE);
+    if (point->window == NULL) return -1;
+    point->bits = bits;
+    point->in = in;
+    point->out = out;
+    /* unroll the circular window so the oldest byte comes first*/
+    if (left) memcpy(point->window, window + GZ_WINDOW_SIZE - left, left);
+    if (left < GZ_WINDOW_SIZE) memcpy(point->window + left, window, GZ_WINDOW_SIZE - left);
+    gzCheckpointCount++;
+    return 0;
+}
+
+/* Decompresses the whole file once, dropping a checkpoint at the first block boundary after every
+ * GZ_CHECKPOINT_SPAN bytes of output. Concatenated gzip members are followed through. */
+void * gzIndexWorker(void * arg)
+{
+    z_stream strm;
+    unsigned char * input = malloc(GZ_INPUT_SIZE);
+    unsigned char * window = malloc(GZ_WINDOW_SIZE);
+    unsigned long totalIn = 0, totalOut = 0, lastPoint = 0, readPos = 0;
+    int ret = Z_OK, state = -1;
+    ssize_t got;
+
+    memset(&strm, 0, sizeof(strm));
+    if (input == NULL || window == NULL || inflateInit2(&strm, 31) != Z_OK)
+    {
+        free(input);
+        free(window);
+        pthread_mutex_lock(&gzIndexLock);
+        gzIndexState = -1;
+        pthread_mutex_unlock(&gzIndexLock);
+        return arg;
+    }
+
+    while (1)
+    {
+        pthread_mutex_lock(&gzIndexLock);
+        if (!gzIndexRunning)
+        {
+            pthread_mutex_unlock(&gzIndexLock);
+            state = 0;
+            break;
+        }
+        pthread_mutex_unlock(&gzIndexLock);
+
+        if (strm.avail_in == 0)
+        {
+            got = pread(fileno(fp), input, GZ_INPUT_SIZE, readPos);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0)
+            {
+                /* clean end only if the last member finished*/
+                state = ret == Z_STREAM_END ? 1 : -1;
+                break;
+            }
+            readPos += got;
+            strm.avail_in = got;
+            strm.next_in = input;
+        }
+        if (ret == Z_STREAM_END)
+        {
+            /* another member might follow, anything else is trailing junk*/
+            if (strm.next_in[0] != 0x1f)
+            {
+                state = 1;
+                break;
+            }
+            inflateReset(&strm);
+        }
+        if (strm.avail_out == 0)
+        {
+            strm.avail_out = GZ_WINDOW_SIZE;
+            strm.next_out = window;
+        }
+
+        totalIn += strm.avail_in;
+        totalOut += strm.avail_out;
+        ret = inflate(&strm, Z_BLOCK); /* stop at the end of each deflate block*/
+        totalIn -= strm.avail_in;
+        totalOut -= strm.avail_out;
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) break;
+
+        pthread_mutex_lock(&gzIndexLock);
+        /* block boundary that isn't the end of the stream*/
+        if ((strm.data_type & 128) && !(strm.data_type & 64) && (totalOut == 0 || totalOut - lastPoint >= GZ_CHECKPOINT_SPAN))
+        {
+            if (addGzCheckpoint(strm.data_type & 7, totalIn, totalOut, strm.avail_out, window))
+            {
+                pthread_mutex_unlock(&gzIndexLock);
+                break;
+            }
+            lastPoint = totalOut;
+        }
+        /* only hand out whole chunks until the end, so nothing gets cached half filled*/
+        gzIndexedLength = totalOut - (totalOut % CHUNK_SIZE);
+        gzIndexedInput = totalIn;
+        pthread_mutex_unlock(&gzIndexLock);
+    }
+
+    inflateEnd(&strm);
+    free(input);
+    free(window);
+    pthread_mutex_lock(&gzIndexLock);
+    if (state != 0)
+    {
+        gzIndexedLength = totalOut;
+        gzIndexedInput = gzFileSize;
+        gzIndexState = state;
+    }
+    pthread_mutex_unlock(&gzIndexLock);
+    return arg;
+}
+
+/* Points gzReader at the closest checkpoint at or before pos. Must hold gzReadLock. */
+int seekGzReader(unsigned long pos)
+{
+    GzCheckpoint point;
+    int low, high, mid, found = -1;
+    unsigned char byte;
+
+    pthread_mutex_lock(&gzIndexLock);
+    low = 0;
+    high = gzCheckpointCount - 1;
+    while (low <= high)
+    {
+        mid = (low + high) / 2;
+        if (gzCheckpoints[mid].out <= pos)
+        {
+            found = mid;
+            low = mid + 1;
+        }
+        else high = mid - 1;
+    }
+    if (found >= 0) point = gzCheckpoints[found];
+    pthread_mutex_unlock(&gzIndexLock);
+    if (found < 0) return -1;
+
+    /* carrying on from where the last read stopped beats going back to the checkpoint*/
+    if (gzReaderValid && gzReaderOut <= pos && gzReaderOut >= point.out) return 0;
+
+    if (gzReaderValid) inflateEnd(&gzReader);
+    gzReaderValid = 0;
+    memset(&gzReader, 0, sizeof(gzReader));
+    if (inflateInit2(&gzReader, -15) != Z_OK) return -1;
+    gzReaderRaw = 1;
+    gzReaderIn = point.in;
+    if (point.bits)
+    {
+        if (pread(fileno(fp), &byte, 1, point.in - 1) != 1)
+        {
+            inflateEnd(&gzReader);
+            return -1;
+        }
+        inflatePrime(&gzReader, point.bits, byte >> (8 - point.bits));
+    }
+    inflateSetDictionary(&gzReader, point.window, GZ_WINDOW_SIZE);
+    gzReaderOut = point.out;
+    gzReaderValid = 1;
+    return 0;
+}
+
+/* Pulls up to len bytes out of gzReader, into dest or nowhere if dest is NULL. Returns the count, or -1. Must hold gzReadLock. */
+long inflateGzReader(unsigned char * dest, unsigned long len)
+{
+    static unsigned char discard[GZ_WINDOW_SIZE];
+    unsigned long done = 0;
+    ssize_t got;
+    int ret;
+
+    while (done < len)
+    {
+        if (gzReader.avail_in == 0)
+        {
+            got = pread(fileno(fp), gzReaderInput, GZ_INPUT_SIZE, gzReaderIn);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) return done ? done : -1;
+            gzReaderIn += got;
+            gzReader.avail_in = got;
+            gzReader.next_in = gzReaderInput;
+        }
+        if (dest != NULL)
+        {
+            gzReader.next_out = dest + done;
+            gzReader.avail_out = len - done;
+        }
+        else
+        {
+            gzReader.next_out = discard;
+            gzReader.avail_out = leastOf(GZ_WINDOW_SIZE, len - done);
+        }
+        got = gzReader.avail_out;
+        ret = inflate(&gzReader, Z_NO_FLUSH);
+        got -= gzReader.avail_out;
+        done += got;
+        gzReaderOut += got;
+
+        if (ret == Z_STREAM_END)
+        {
+            /* end of a member. A raw stream leaves the trailer behind, the gzip wrapper eats it*/
+            unsigned skip = gzReaderRaw ? GZ_TRAILER_SIZE : 0;
+            while (skip > 0)
+            {
+                if (gzReader.avail_in == 0)
+                {
+                    got = pread(fileno(fp), gzReaderInput, GZ_INPUT_SIZE, gzReaderIn);
+                    if (got <= 0) return done ? done : -1;
+                    gzReaderIn += got;
+                    gzReader.avail_in = got;
+                    gzReader.next_in = gzReaderInput;
+                }
+                got = leastOf(skip, gzReader.avail_in);
+                gzReader.next_in += got;
+                gzReader.avail_in -= got;
+                skip -= got;
+            }
+            if (inflateReset2(&gzReader, 31) != Z_OK) return -1;
+            gzReaderRaw = 0;
+        }
+        else if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            return -1;
+        }
+    }
+    return done;
+}
+
+/* Decompresses len bytes from start into dest, from the nearest checkpoint. Returns 0, or -1 on error. */
+int readCompressed(unsigned long start, unsigned char * dest, unsigned long len)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&gzReadLock);
+    if (seekGzReader(start) == 0
+        && inflateGzReader(NULL, start - gzReaderOut) >= 0
+        && gzReaderOut == start
+        && inflateGzReader(dest, len) == len)
+    {
+        ret = 0;
+    }
+    else if (gzReaderValid)
+    {
+        /* leave it for the next read to start over*/
+        inflateEnd(&gzReader);
+        gzReaderValid = 0;
+    }
+    pthread_mutex_unlock(&gzReadLock);
+    return ret;
+}
+
+/* A gzip file can't be edited in place, so the buffer goes out uncompressed to a file of the user's choosing. */
+int saveDecompressed()
+{
+    char outName[BUFFER_LENGTH];
+    unsigned char * block;
+    unsigned long pos, count;
+    int state, outFd;
+
+    pthread_mutex_lock(&gzIndexLock);
+    state = gzIndexState;
+    pthread_mutex_unlock(&gzIndexLock);
+    if (state == 0)
+    {
+        sprintf(userOutput, "Error: Still decompressing, try again when indexing is done.");
+        return -1;
+    }
+
+    snprintf(outName, sizeof(outName), "%s", filename);
+    decompressedName(outName);
+
+    sprintf(userOutput, "Save uncompressed (enter for default):");
+    inputPopup(userOutput);
+    if (exitSignal) return -1;
+    if (strlen(userInput) > 0) snprintf(outName, sizeof(outName), "%s", userInput);
+
+    outFd = open(outName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    block = malloc(CHUNK_SIZE * 16);
+    if (outFd < 0 || block == NULL)
+    {
+        if (outFd >= 0) close(outFd);
+        free(block);
+        sprintf(userOutput, "Error: Couldn't save to %.200s", outName);
+        return -1;
+    }
+    for (pos = 0; pos < bufferLength; pos += count)
+    {
+        count = readBuffer(pos, block, CHUNK_SIZE * 16);
+        if (count == 0 || writeSparse(outFd, block, count, pos, 0)) break;
+    }
+    free(block);
+    /* a run of zeros at the end still has to make it into the size*/
+    if (pos == bufferLength && ftruncate(outFd, bufferLength) != 0) pos = 0;
+    if (close(outFd) != 0 || pos < bufferLength)
+    {
+        sprintf(userOutput, "Error: Couldn't save to %.200s", outName);
+        return -1;
+    }
+    bufferModified = 0;
+    sprintf(userOutput, "Buffer saved uncompressed to %.200s", outName);
+    return 0;
+}
+
+/* Turns name (BUFFER_LENGTH long) into the default name for the decompressed file, which is the name without its .gz */
+void decompressedName(char * name)
+{
+    if (strlen(name) > 3 && strcmp(name + strlen(name) - 3, ".gz") == 0) name[strlen(name) - 3] = 0;
+    else strncat(name, ".raw", BUFFER_LENGTH - strlen(name) - 1);
+}
+
+/* Allocates the strings index for the current buffer and starts the scan threads, if they aren't already going. */
+int startStrings()
+{
+    long threads;
+
+    if (stringsThreadCount > 0) return 0;
+
+    /* an index brought back by loadSession is already there, only what it hadn't got to gets scanned*/
+    if (stringsChunks == NULL)
+    {
+        stringsChunkCount = (bufferLength + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        stringsChunks = calloc(stringsChunkCount ? stringsChunkCount : 1, sizeof(StringsChunk));
+        if (stringsChunks == NULL) return -1;
+        stringsLength = bufferLength;
+        stringsScanFrom = 0;
+        stringsScanned = 0;
+        stringsFound = 0;
+    }
+    stringsRunning = 1;
+
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > STRINGS_MAX_THREADS) threads = STRINGS_MAX_THREADS;
+    for (stringsThreadCount = 0; stringsThreadCount < threads; stringsThreadCount++)
+    {
+        if (pthread_create(&stringsThreads[stringsThreadCount], NULL, stringsWorker, NULL) != 0) break;
+    }
+    if (stringsThreadCount == 0)
+    {
+        stopStrings();
+        return -1;
+    }
+    return 0;
+}
+
+/* Stops the scan threads and throws the index away. */
+void stopStrings()
+{
+    long i;
+    if (stringsChunks == NULL) return;
+
+    pthread_mutex_lock(&stringsLock);
+    stringsRunning = 0;
+    pthread_cond_broadcast(&stringsCond);
+    pthread_mutex_unlock(&stringsLock);
+    for (i = 0; i < stringsThreadCount; i++)
+    {
+        pthread_join(stringsThreads[i], NULL);
+    }
+    stringsThreadCount = 0;
+
+    for (i = 0; i < stringsChunkCount; i++)
+    {
+        free(stringsChunks[i].entries);
+    }
+    free(stringsChunks);
+    stringsChunks = NULL;
+    stringsChunkCount = 0;
+}
+
+/* Called from the main loop. Picks up chunks a growing buffer (gzip indexing) has added since the scan started. */
+void syncStrings()
+{
+    long newCount;
+    StringsChunk * grown;
+
+    if (stringsChunks == NULL || stringsLength == bufferLength) return;
+
+    newCount = (bufferLength + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    pthread_mutex_lock(&stringsLock);
+    if (newCount > stringsChunkCount)
+    {
+        grown = realloc(stringsChunks, sizeof(StringsChunk) * newCount);
+        if (grown == NULL)
+        {
+            pthread_mutex_unlock(&stringsLock);
+            return;
+        }
+        memset(grown + stringsChunkCount, 0, sizeof(StringsChunk) * (newCount - stringsChunkCount));
+        stringsChunks = grown;
+        stringsChunkCount = newCount;
+    }
+    stringsLength = bufferLength;
+    pthread_mutex_unlock(&stringsLock);
+
+    /* the old last chunk's final string may carry on into the new data*/
+    markStringsStale(stringsLength ? stringsLength - 1 : 0, 1);
+}
+
+/* Queues the chunks around an edit for rescanning. The chunk before and after are included
+ * since a string can run across the boundary. */
+void markStringsStale(unsigned long pos, unsigned long len)
+{
+    long first, last, i;
+
+    if (stringsChunks == NULL) return;
+
+    pthread_mutex_lock(&stringsLock);
+    first = pos / CHUNK_SIZE - 1;
+    last = (pos + len) / CHUNK_SIZE;
+    if (first < 0) first = 0;
+    if (last >= stringsChunkCount) last = stringsChunkCount - 1;
+    for (i = first; i <= last; i++)
+    {
+        if (stringsChunks[i].state == CHUNK_SCANNED)
+        {
+            stringsScanned--;
+            stringsFound -= stringsChunks[i].count;
+        }
+        stringsChunks[i].state = CHUNK_PENDING;
+        stringsChunks[i].version++;
+    }
+    if (first < stringsScanFrom) stringsScanFrom = first;
+    pthread_cond_broadcast(&stringsCond);
+    pthread_mutex_unlock(&stringsLock);
+}
+
+/* Builds bitmaps, one bit per byte, of which bytes could be part of a string and which are zero.
+ * len must be a multiple of 64. */
+void classifyPrintable(const unsigned char * data, int len, uint64_t * printable, uint64_t * zero)
+{
+    int i, j;
+    uint64_t p, z;
+#ifdef __SSE2__
+    const __m128i low = _mm_set1_epi8(0x1f);
+    const __m128i high = _mm_set1_epi8(0x7f);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i nul = _mm_setzero_si128();
+    __m128i v, isPrintable;
+
+    for (i = 0; i < len; i += 64)
+    {
+        p = 0;
+        z = 0;
+        for (j = 0; j < 64; j += 16)
+        {
+            /* signed compares, so anything 0x80 and up falls below 0x1f*/
+            v = _mm_loadu_si128((const __m128i *) (data + i + j));
+            isPrintable = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi8(v, low), _mm_cmplt_epi8(v, high)), _mm_cmpeq_epi8(v, tab));
+            p |= (uint64_t) (unsigned) _mm_movemask_epi8(isPrintable) << j;
+            z |= (uint64_t) (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, nul)) << j;
+        }
+        printable[i / 64] = p;
+        zero[i / 64] = z;
+    }
+#else
+    for (i = 0; i < len; i += 64)
+    {
+        p = 0;
+        z = 0;
+        for (j = 0; j < 64; j++)
+        {
+            if (IS_STRING_CHAR(data[i + j])) p |= (uint64_t) 1 << j;
+            if (data[i + j] == 0) z |= (uint64_t) 1 << j;
+        }
+        printable[i / 64] = p;
+        zero[i / 64] = z;
+    }
+#endif
+}
+
+/* Returns the first bit at or after from that is set (value 1) or clear (value 0), or end if there isn't one. */
+long nextBit(const uint64_t * bitmap, long from, long end, int value)
+{
+    uint64_t word;
+    while (from < end)
+    {
+        word = value ? bitmap[from / 64] : ~bitmap[from / 64];
+        word &= ~(uint64_t) 0 << (from % 64);
+        if (word)
+        {
+            from = (from & ~63L) + __builtin_ctzll(word);
+            return from < end ? from : end;
+        }
+        from = (from & ~63L) + 64;
+    }
+    return end;
+}
+
+/* Follows a string that runs off the end of a chunk. Returns the offset just past its end. */
+unsigned long extendString(unsigned long pos, int wide)
+{
+    unsigned char block[256];
+    unsigned long got, i;
+
+    while ((got = peekBuffer(pos, block, sizeof(block))) > 0)
+    {
+        if (wide)
+        {
+            for (i = 0; i + 1 < got && IS_STRING_CHAR(block[i]) && block[i + 1] == 0; i += 2);
+        }
+        else
+        {
+            for (i = 0; i < got && IS_STRING_CHAR(block[i]); i++);
+        }
+        pos += i;
+        if (i < got) break;
+    }
+    return pos;
+}
+
+/* Finds every string that starts in the chunk, ASCII and UTF-16LE, sorted by offset.
+ * Strings that start in the previous chunk belong to it. Returns the count, found is malloc'd. */
+int scanStringsChunk(long index, unsigned char * data, uint64_t * printable, uint64_t * zero, StringEntry ** found)
+{
+    unsigned long start = index * CHUNK_SIZE;
+    unsigned long end;
+    unsigned char before[2] = {0, 0};
+    unsigned char after = 1;
+    long len, pos, runStart, runEnd, i;
+    long wideStart[2], wideNext[2];
+    int wideOwned[2];
+    int count = 0, capacity = 64, parity;
+    StringEntry * entries = malloc(sizeof(StringEntry) * capacity);
+    uint64_t wide;
+
+    *found = NULL;
+    if (entries == NULL) return 0;
+
+    /* a hole has no strings, and nothing can run into it*/
+    pthread_mutex_lock(&cacheLock);
+    len = holesMapped && findDirtyChunk(index) == NULL && rangeIsHole(start, CHUNK_SIZE);
+    pthread_mutex_unlock(&cacheLock);
+    if (len)
+    {
+        *found = entries;
+        return 0;
+    }
+
+    len = peekBuffer(start, data, CHUNK_SIZE);
+    memset(data + len, 0, CHUNK_SIZE - len);
+    classifyPrintable(data, CHUNK_SIZE, printable, zero);
+    if (start >= 2) peekBuffer(start - 2, before, 2);
+    else if (start == 1) peekBuffer(0, before + 1, 1);
+    peekBuffer(start + len, &after, 1);
+
+    /* padding past the end isn't really zero*/
+    for (i = len; i < CHUNK_SIZE; i++)
+    {
+        zero[i / 64] &= ~((uint64_t) 1 << (i % 64));
+    }
+    zero[CHUNK_SIZE / 64] = (len == CHUNK_SIZE && after == 0) ? 1 : 0;
+
+#define ADD_STRING(o, n, w) \
+    if (count == capacity) \
+    { \
+        StringEntry * grown = realloc(entries, sizeof(StringEntry) * capacity * 2); \
+        if (grown == NULL) break; \
+        entries = grown; \
+        capacity *= 2; \
+    } \
+    entries[count].offset = (o); \
+    entries[count].length = (n); \
+    entries[count].wide = (w); \
+    count++;
+
+    /* ASCII: runs of set bits*/
+    pos = 0;
+    while ((runStart = nextBit(printable, pos, len, 1)) < len)
+    {
+        runEnd = nextBit(printable, runStart, len, 0);
+        pos = runEnd;
+        if (runStart == 0 && start > 0 && IS_STRING_CHAR(before[1])) continue;
+        end = runEnd == len ? extendString(start + len, 0) : start + runEnd;
+        if (end - (start + runStart) >= stringsMinLength)
+        {
+            ADD_STRING(start + runStart, end - (start + runStart), 0);
+        }
+    }
+
+    /* UTF-16LE: a printable byte followed by a zero, repeated every other byte. Tracked per alignment*/
+    wideStart[0] = wideStart[1] = -1;
+    wideNext[0] = wideNext[1] = -1;
+    for (i = 0; i <= len / 64 && i < CHUNK_SIZE / 64; i++)
+    {
+        wide = printable[i] & ((zero[i] >> 1) | (zero[i + 1] << 63));
+        while (wide)
+        {
+            pos = i * 64 + __builtin_ctzll(wide);
+            wide &= wide - 1;
+            if (pos >= len) break;
+            parity = pos & 1;
+            if (wideStart[parity] >= 0 && pos == wideNext[parity])
+            {
+                wideNext[parity] += 2;
+                continue;
+            }
+            if (wideStart[parity] >= 0 && wideOwned[parity] && (wideNext[parity] - wideStart[parity]) / 2 >= stringsMinLength)
+            {
+                ADD_STRING(start + wideStart[parity], (wideNext[parity] - wideStart[parity]) / 2, 1);
+            }
+            wideStart[parity] = pos;
+            wideNext[parity] = pos + 2;
+            /* a run right at the start may have carried on from the previous chunk*/
+            wideOwned[parity] = !(pos < 2 && start >= 2
+                && (parity == 0 ? (IS_STRING_CHAR(before[0]) && before[1] == 0) : (IS_STRING_CHAR(before[1]) && data[0] == 0)));
+        }
+    }
+    for (parity = 0; parity < 2; parity++)
+    {
+        if (wideStart[parity] < 0 || !wideOwned[parity]) continue;
+        end = wideNext[parity] >= len ? extendString(start + wideNext[parity], 1) : start + wideNext[parity];
+        if ((end - (start + wideStart[parity])) / 2 >= stringsMinLength)
+        {
+            ADD_STRING(start + wideStart[parity], (end - (start + wideStart[parity])) / 2, 1);
+        }
+    }
+#undef ADD_STRING
+
+    qsort(entries, count, sizeof(StringEntry), compareStrings);
+    *found = entries;
+    return count;
+}
+
+int compareStrings(const void * a, const void * b)
+{
+    const StringEntry * x = a;
+    const StringEntry * y = b;
+    if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    return x->wide - y->wide;
+}
+
+/* Scan thread. Takes the lowest pending chunk, scans it without any locks held, and files the
+ * result unless the chunk was edited in the meantime. */
+void * stringsWorker(void * arg)
+{
+    unsigned char * data = malloc(CHUNK_SIZE);
+    uint64_t * printable = malloc(CHUNK_SIZE / 8 + sizeof(uint64_t));
+    uint64_t * zero = malloc(CHUNK_SIZE / 8 + sizeof(uint64_t));
+    StringEntry * found;
+    unsigned int version;
+    long index;
+    int count;
+
+    if (data == NULL || printable == NULL || zero == NULL)
+    {
+        free(data);
+        free(printable);
+        free(zero);
+        return arg;
+    }
+
+    pthread_mutex_lock(&stringsLock);
+    while (stringsRunning)
+    {
+        for (index = stringsScanFrom; index < stringsChunkCount && stringsChunks[index].state != CHUNK_PENDING; index++);
+        if (index >= stringsChunkCount)
+        {
+            stringsScanFrom = index;
+            pthread_cond_wait(&stringsCond, &stringsLock);
+            continue;
+        }
+        stringsScanFrom = index + 1;
+        stringsChunks[index].state = CHUNK_SCANNING;
+        version = stringsChunks[index].version;
+        pthread_mutex_unlock(&stringsLock);
+
+        count = scanStringsChunk(index, data, printable, zero, &found);
+
+        pthread_mutex_lock(&stringsLock);
+        if (!stringsRunning || index >= stringsChunkCount || stringsChunks[index].version != version)
+        {
+            /* edited while we were looking, markStringsStale has already queued it again*/
+            free(found);
+            continue;
+        }
+        if (stringsChunks[index].state != CHUNK_SCANNED)
+        {
+            stringsScanned++;
+            stringsFound += count;
+        }
+        else stringsFound += count - stringsChunks[index].count;
+        free(stringsChunks[index].entries);
+        stringsChunks[index].entries = found;
+        stringsChunks[index].count = count;
+        stringsChunks[index].state = CHUNK_SCANNED;
+    }
+    pthread_mutex_unlock(&stringsLock);
+
+    free(data);
+    free(printable);
+    free(zero);
+    return arg;
+}
+
+/* Moves a (chunk, entry) position to the next or previous string in the index. Returns -1 at either end.
+ * Must hold stringsLock. */
+int stepString(long * chunk, int * entry, int direction)
+{
+    long c = *chunk;
+
+    if (direction == DIRECTION_FORWARD && c < stringsChunkCount && *entry + 1 < stringsChunks[c].count)
+    {
+        (*entry)++;
+        return 0;
+    }
+    if (direction == DIRECTION_BACKWARD && c < stringsChunkCount && *entry > 0 && *entry <= stringsChunks[c].count)
+    {
+        (*entry)--;
+        return 0;
+    }
+    for (c += direction; c >= 0 && c < stringsChunkCount; c += direction)
+    {
+        if (stringsChunks[c].count > 0)
+        {
+            *chunk = c;
+            *entry = direction == DIRECTION_FORWARD ? 0 : stringsChunks[c].count - 1;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* The strings list, drawn over the editor. Fills in while the scan runs.
+ * Up/Down/PgUp/PgDn pick a string, Enter jumps to it, 'n' changes the minimum length, 'q' closes. */
+void stringsPanel()
+{
+    StringEntry visible[STRINGS_PANEL_ROWS];
+    unsigned char text[STRINGS_PANEL_COLS * 2];
+    long selChunk, topChunk;
+    int selEntry, topEntry;
+    int selRow = 0, rows, cols, shown, row, i, ch, step, done = 0;
+    unsigned long got;
+
+    if (startStrings())
+    {
+        sprintf(userOutput, "Error: Couldn't start the strings scan.");
+        return;
+    }
+
+    /* start on the first string at or after the cursor*/
+    selChunk = curBufPos / CHUNK_SIZE;
+    selEntry = 0;
+    pthread_mutex_lock(&stringsLock);
+    if (selChunk < stringsChunkCount)
+    {
+        while (selEntry < stringsChunks[selChunk].count && stringsChunks[selChunk].entries[selEntry].offset < curBufPos) selEntry++;
+    }
+    pthread_mutex_unlock(&stringsLock);
+
+    while (!done)
+    {
+        rows = getmaxy(editorWin);
+        cols = getmaxx(editorWin);
+        if (rows > STRINGS_PANEL_ROWS) rows = STRINGS_PANEL_ROWS;
+        if (selRow >= rows) selRow = rows - 1; /* the terminal got shorter*/
+
+        pthread_mutex_lock(&stringsLock);
+        /* the selected chunk may have been rescanned since last time*/
+        if (selChunk >= stringsChunkCount) selChunk = stringsChunkCount ? stringsChunkCount - 1 : 0;
+        if (selChunk < stringsChunkCount && selEntry >= stringsChunks[selChunk].count)
+        {
+            selEntry = stringsChunks[selChunk].count;
+            if (stepString(&selChunk, &selEntry, DIRECTION_FORWARD)) stepString(&selChunk, &selEntry, DIRECTION_BACKWARD);
+        }
+        /* work back from the selection to find the top row*/
+        topChunk = selChunk;
+        topEntry = selEntry;
+        for (i = 0; i < selRow && stepString(&topChunk, &topEntry, DIRECTION_BACKWARD) == 0; i++);
+        selRow = i;
+        shown = 0;
+        if (topChunk < stringsChunkCount && topEntry < stringsChunks[topChunk].count)
+        {
+            do
+            {
+                visible[shown++] = stringsChunks[topChunk].entries[topEntry];
+            }
+            while (shown < rows && stepString(&topChunk, &topEntry, DIRECTION_FORWARD) == 0);
+        }
+        sprintf(userOutput, "Strings: %ld found, %ld%% scanned. Enter jumps, 'n' min length (%d), 'q' closes",
+                stringsFound, stringsChunkCount ? stringsScanned * 100 / stringsChunkCount : 100, stringsMinLength);
+        pthread_mutex_unlock(&stringsLock);
+
+        werase(editorWin);
+        for (row = 0; row < shown; row++)
+        {
+            /* the text comes from the buffer, so it's read without the index locked*/
+            got = readBuffer(visible[row].offset, text, leastOf(visible[row].length << visible[row].wide, sizeof(text)));
+            if (row == selRow) wattron(editorWin, A_REVERSE);
+            wmove(editorWin, row, 0);
+            wattron(editorWin, A_BOLD);
+            wprintw(editorWin, "0x%0*lX", offsetDigits(), visible[row].offset);
+            wattroff(editorWin, A_BOLD);
+            wprintw(editorWin, " %c %c %c ", SEPARATOR, visible[row].wide ? 'W' : 'A', SEPARATOR);
+            for (i = 0; i < got && getcurx(editorWin) < cols - 1; i += 1 + visible[row].wide)
+            {
+                waddch(editorWin, text[i] == '\t' ? ' ' : text[i]);
+            }
+            if (row == selRow) wattroff(editorWin, A_REVERSE);
+        }
+        wnoutrefresh(editorWin);
+        drawUserWin();
+        refreshScreen();
+
+        ch = getch();
+        if (exitSignal) break; /* closes the list, the main loop does the rest*/
+        step = 0;
+        if (ch == KEY_DOWN) step = 1;
+        else if (ch == KEY_UP) step = -1;
+        else if (ch == KEY_NPAGE) step = rows;
+        else if (ch == KEY_PPAGE) step = -rows;
+        else if ((ch == '\n' || ch == KEY_ENTER) && shown > 0)
+        {
+            int direction = visible[selRow].offset < curBufPos ? DIRECTION_BACKWARD : DIRECTION_FORWARD;
+            curBufPos = visible[selRow].offset;
+            curBufPosHalf = 0;
+            requestPrefetch(direction);
+            sprintf(userOutput, "Moved cursor to string");
+            done = 1;
+        }
+        else if (ch == 'n')
+        {
+            sprintf(userOutput, "Minimum string length:");
+            inputPopup(userOutput);
+            if (exitSignal) break;
+            if (strtol(userInput, NULL, 0) >= 1)
+            {
+                stopStrings();
+                stringsMinLength = strtol(userInput, NULL, 0);
+                if (startStrings())
+                {
+                    sprintf(userOutput, "Error: Couldn't start the strings scan.");
+                    return;
+                }
+            }
+        }
+        else if (ch == KEY_RESIZE)
+        {
+            resizeScreen();
+        }
+        else if (ch == 'q' || ch == 'T' || ch == 27)
+        {
+            sprintf(userOutput, "Closed strings list");
+            done = 1;
+        }
+
+        pthread_mutex_lock(&stringsLock);
+        for (; step > 0 && stepString(&selChunk, &selEntry, DIRECTION_FORWARD) == 0; step--)
+        {
+            if (selRow < rows - 1) selRow++;
+        }
+        for (; step < 0 && stepString(&selChunk, &selEntry, DIRECTION_BACKWARD) == 0; step++)
+        {
+            if (selRow > 0) selRow--;
+        }
+        pthread_mutex_unlock(&stringsLock);
+    }
+}
+
+/* Reads a signature list, one per line: a name, then either hex bytes (spaces allowed) or "quoted text".
+ * Blank lines and lines starting with '#' are skipped. Replaces the current list and rebuilds the automaton.
+ * Returns -1 with the reason in userOutput. */
+int loadSignatures(const char * path)
+{
+    FILE * in;
+    char line[BUFFER_LENGTH * 2];
+    Signature * loaded;
+    int count = 0, lineNumber = 0, failed = 0;
+
+    in = fopen(path, "r");
+    if (in == NULL)
+    {
+        sprintf(userOutput, "Error: Couldn't open %.200s", path);
+        return -1;
+    }
+    loaded = malloc(sizeof(Signature) * SIGNATURES_MAX);
+    if (loaded == NULL)
+    {
+        fclose(in);
+        sprintf(userOutput, "Error: Out of memory loading signatures.");
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        char * p = line;
+        char * name;
+        Signature * sig = &loaded[count];
+
+        lineNumber++;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0) continue;
+        if (count == SIGNATURES_MAX)
+        {
+            sprintf(userOutput, "Error: More than %d signatures in %.150s", SIGNATURES_MAX, path);
+            failed = 1;
+            break;
+        }
+        name = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+        snprintf(sig->name, sizeof(sig->name), "%.*s", (int) (p - name), name);
+        sig->length = parsePattern(p, sig->bytes, SIGNATURE_MAX_LENGTH);
+        if (sig->length <= 0)
+        {
+            sprintf(userOutput, "Error: Bad signature on line %d of %.150s", lineNumber, path);
+            failed = 1;
+            break;
+        }
+        count++;
+    }
+    if (!failed && ferror(in))
+    {
+        sprintf(userOutput, "Error: Couldn't read %.200s", path);
+        failed = 1;
+    }
+    if (!failed && count == 0)
+    {
+        sprintf(userOutput, "Error: No signatures in %.200s", path);
+        failed = 1;
+    }
+    fclose(in);
+    if (failed)
+    {
+        free(loaded);
+        return -1;
+    }
+
+    stopSignatures();
+    free(signatures);
+    signatures = loaded;
+    signatureCount = count;
+    if (buildAutomaton())
+    {
+        free(signatures);
+        signatures = NULL;
+        signatureCount = 0;
+        sprintf(userOutput, "Error: Out of memory building the signature automaton.");
+        return -1;
+    }
+    /* at startup it's given signatureFile itself, which mustn't be copied over itself*/
+    if (path != signatureFile) snprintf(signatureFile, sizeof(signatureFile), "%s", path);
+    return 0;
+}
+
+void freeAutomaton()
+{
+    free(acTable);
+    free(acOutStart);
+    free(acOutCount);
+    free(acOutList);
+    acTable = NULL;
+    acOutStart = NULL;
+    acOutCount = NULL;
+    acOutList = NULL;
+    acStateCount = 0;
+}
+
+/* Builds the Aho-Corasick automaton for the loaded signatures as a full DFA, so scanning is one table
+ * lookup per byte no matter how many signatures there are. Bytes no signature uses share class 0, which
+ * keeps each state's row to acClassCount entries. Returns -1 if out of memory. */
+int buildAutomaton()
+{
+    int * go = NULL;
+    int * fail = NULL;
+    int * queue = NULL;
+    int * firstSig = NULL; /* the signatures ending at each state, chained through nextSig*/
+    int * nextSig = NULL;
+    long maxStates = 1, outTotal = 0;
+    int i, j, c, s, t, head, tail, ok, states = 1;
+
+    freeAutomaton();
+    memset(acClass, 0, sizeof(acClass));
+    acClassCount = 1;
+    signatureMaxLength = 0;
+    signatureZeroStart = 0;
+    for (i = 0; i < signatureCount; i++)
+    {
+        for (j = 0; j < signatures[i].length; j++)
+        {
+            if (acClass[signatures[i].bytes[j]] == 0) acClass[signatures[i].bytes[j]] = acClassCount++;
+        }
+        if (signatures[i].length > signatureMaxLength) signatureMaxLength = signatures[i].length;
+        if (signatures[i].bytes[0] == 0) signatureZeroStart = 1;
+        maxStates += signatures[i].length;
+    }
+
+    go = malloc(sizeof(int) * maxStates * acClassCount);
+    fail = calloc(maxStates, sizeof(int));
+    queue = malloc(sizeof(int) * maxStates);
+    firstSig = malloc(sizeof(int) * maxStates);
+    nextSig = malloc(sizeof(int) * signatureCount);
+    acOutStart = malloc(sizeof(int) * maxStates);
+    acOutCount = calloc(maxStates, sizeof(int));
+    ok = go != NULL && fail != NULL && queue != NULL && firstSig != NULL && nextSig != NULL && acOutStart != NULL && acOutCount != NULL;
+
+    if (ok)
+    {
+        /* the trie, a level at a time so states are numbered by depth and the busy shallow rows sit together.
+         * queue holds where each signature has got to until it's needed for the breadth first pass*/
+        memset(go, 0xff, sizeof(int) * maxStates * acClassCount);
+        memset(firstSig, 0xff, sizeof(int) * maxStates);
+        memset(queue, 0, sizeof(int) * signatureCount);
+        for (j = 0; j < signatureMaxLength; j++)
+        {
+            for (i = 0; i < signatureCount; i++)
+            {
+                if (j >= signatures[i].length) continue;
+                s = queue[i];
+                c = acClass[signatures[i].bytes[j]];
+                if (go[s * acClassCount + c] < 0) go[s * acClassCount + c] = states++;
+                queue[i] = go[s * acClassCount + c];
+                if (j == signatures[i].length - 1)
+                {
+                    nextSig[i] = firstSig[queue[i]];
+                    firstSig[queue[i]] = i;
+                }
+            }
+        }
+
+        /* breadth first, so a state's failure state is always finished before it is. Missing transitions
+         * are filled in from the failure state, which turns the trie into a DFA*/
+        head = tail = 0;
+        queue[tail++] = 0;
+        for (c = 0; c < acClassCount; c++)
+        {
+            if (go[c] < 0) go[c] = 0;
+            else queue[tail++] = go[c];
+        }
+        for (head = 1; head < tail; head++)
+        {
+            s = queue[head];
+            for (c = 0; c < acClassCount; c++)
+            {
+                t = go[s * acClassCount + c];
+                if (t < 0) go[s * acClassCount + c] = go[fail[s] * acClassCount + c];
+                else
+                {
+                    fail[t] = go[fail[s] * acClassCount + c];
+                    queue[tail++] = t;
+                }
+            }
+        }
+
+        /* every state reports its own signatures plus everything its failure state reports*/
+        for (head = 1; head < tail; head++)
+        {
+            s = queue[head];
+            for (i = firstSig[s]; i >= 0; i = nextSig[i]) acOutCount[s]++;
+            acOutCount[s] += acOutCount[fail[s]];
+            outTotal += acOutCount[s];
+        }
+        acOutList = malloc(sizeof(int) * (outTotal ? outTotal : 1));
+        ok = acOutList != NULL;
+    }
+    if (ok)
+    {
+        outTotal = 0;
+        acOutStart[0] = 0;
+        for (head = 1; head < tail; head++)
+        {
+            s = queue[head];
+            acOutStart[s] = outTotal;
+            for (i = firstSig[s]; i >= 0; i = nextSig[i]) acOutList[outTotal++] = i;
+            for (i = 0; i < acOutCount[fail[s]]; i++) acOutList[outTotal++] = acOutList[acOutStart[fail[s]] + i];
+        }
+        acTable = malloc(sizeof(uint32_t) * states * acClassCount);
+        ok = acTable != NULL;
+    }
+    if (ok)
+    {
+        /* rows hold the offset of the next state's row, with AC_MATCH set if that state reports anything*/
+        for (i = 0; i < states * acClassCount; i++)
+        {
+            t = go[i];
+            acTable[i] = (uint32_t) (t * acClassCount) | (acOutCount[t] ? AC_MATCH : 0);
+        }
+        acStateCount = states;
+    }
+
+    free(go);
+    free(fail);
+    free(queue);
+    free(firstSig);
+    free(nextSig);
+    if (!ok) freeAutomaton();
+    return ok ? 0 : -1;
+}
+
+/* Allocates the hit index for the current buffer and starts the scan threads, if they aren't already going. */
+int startSignatures()
+{
+    long threads;
+
+    if (hitsThreadCount > 0) return 0;
+    if (acTable == NULL) return -1;
+
+    if (hitChunks == NULL)
+    {
+        hitChunkCount = (bufferLength + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        hitChunks = calloc(hitChunkCount ? hitChunkCount : 1, sizeof(HitChunk));
+        if (hitChunks == NULL) return -1;
+        hitsLength = bufferLength;
+        hitsScanFrom = 0;
+        hitsScanned = 0;
+        hitsFound = 0;
+    }
+    hitsRunning = 1;
+
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > STRINGS_MAX_THREADS) threads = STRINGS_MAX_THREADS;
+    for (hitsThreadCount = 0; hitsThreadCount < threads; hitsThreadCount++)
+    {
+        if (pthread_create(&hitsThreads[hitsThreadCount], NULL, signaturesWorker, NULL) != 0) break;
+    }
+    if (hitsThreadCount == 0)
+    {
+        stopSignatures();
+        return -1;
+    }
+    return 0;
+}
+
+/* Stops the scan threads and throws the hits away. The signatures stay loaded. */
+void stopSignatures()
+{
+    long i;
+    if (hitChunks == NULL) return;
+
+    pthread_mutex_lock(&hitsLock);
+    hitsRunning = 0;
+    pthread_cond_broadcast(&hitsCond);
+    pthread_mutex_unlock(&hitsLock);
+    for (i = 0; i < hitsThreadCount; i++)
+    {
+        pthread_join(hitsThreads[i], NULL);
+    }
+    hitsThreadCount = 0;
+
+    for (i = 0; i < hitChunkCount; i++)
+    {
+        free(hitChunks[i].hits);
+    }
+    free(hitChunks);
+    hitChunks = NULL;
+    hitChunkCount = 0;
+}
+
+/* Called from the main loop. Picks up chunks a growing buffer has added since the scan started. */
+void syncSignatures()
+{
+    long newCount;
+    HitChunk * grown;
+
+    if (hitChunks == NULL || hitsLength == bufferLength) return;
+
+    newCount = (bufferLength + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    pthread_mutex_lock(&hitsLock);
+    if (newCount > hitChunkCount)
+    {
+        grown = realloc(hitChunks, sizeof(HitChunk) * newCount);
+        if (grown == NULL)
+        {
+            pthread_mutex_unlock(&hitsLock);
+            return;
+        }
+        memset(grown + hitChunkCount, 0, sizeof(HitChunk) * (newCount - hitChunkCount));
+        hitChunks = grown;
+        hitChunkCount = newCount;
+    }
+    hitsLength = bufferLength;
+    pthread_mutex_unlock(&hitsLock);
+
+    /* a signature can start in the old last chunk and finish in the new data*/
+    markSignaturesStale(hitsLength ? hitsLength - 1 : 0, 1);
+}
+
+/* Queues the chunks an edit could have changed a hit in, which reaches back one signature length. */
+void markSignaturesStale(unsigned long pos, unsigned long len)
+{
+    long first, last, i;
+
+    if (hitChunks == NULL) return;
+
+    pthread_mutex_lock(&hitsLock);
+    first = (pos > signatureMaxLength ? pos - signatureMaxLength : 0) / CHUNK_SIZE;
+    last = (pos + len) / CHUNK_SIZE;
+    if (last >= hitChunkCount) last = hitChunkCount - 1;
+    for (i = first; i <= last; i++)
+    {
+        if (hitChunks[i].state == CHUNK_SCANNED)
+        {
+            hitsScanned--;
+            hitsFound -= hitChunks[i].count;
+        }
+        hitChunks[i].state = CHUNK_PENDING;
+        hitChunks[i].version++;
+    }
+    if (first < hitsScanFrom) hitsScanFrom = first;
+    pthread_cond_broadcast(&hitsCond);
+    pthread_mutex_unlock(&hitsLock);
+}
+
+/* Files the signatures the automaton reports on reaching entry with data[end], for the ones starting in [from, to).
+ * Returns the new count. */
+int reportHits(uint32_t entry, long end, long from, long to, unsigned long start, SignatureHit ** hits, int count, int * capacity)
+{
+    int state = (entry & ~AC_MATCH) / acClassCount;
+    int k;
+
+    for (k = 0; k < acOutCount[state]; k++)
+    {
+        int sig = acOutList[acOutStart[state] + k];
+        long offset = end + 1 - signatures[sig].length;
+        /* the walk that owns that spot reports it*/
+        if (offset < from || offset >= to) continue;
+        if (count == *capacity)
+        {
+            SignatureHit * grown = realloc(*hits, sizeof(SignatureHit) * *capacity * 2);
+            if (grown == NULL) break;
+            *hits = grown;
+            *capacity *= 2;
+        }
+        (*hits)[count].offset = start + offset;
+        (*hits)[count].signature = sig;
+        count++;
+    }
+    return count;
+}
+
+/* Runs the automaton over one chunk, plus enough of the next to finish any signature that starts in this one.
+ * data needs room for CHUNK_SIZE + SIGNATURE_MAX_LENGTH bytes. Returns the number of hits, sorted, in found. */
+int scanSignaturesChunk(long index, unsigned char * data, SignatureHit ** found)
+{
+    unsigned long start = index * CHUNK_SIZE;
+    uint32_t entry[SIGNATURE_LANES], seen;
+    const long span = CHUNK_SIZE / SIGNATURE_LANES;
+    long len, steps, common, i, lane, end;
+    int count = 0, capacity = 16;
+    SignatureHit * hits = malloc(sizeof(SignatureHit) * capacity);
+
+    *found = hits;
+    if (hits == NULL) return 0;
+
+    /* only a signature that starts with a zero can begin in a hole*/
+    pthread_mutex_lock(&cacheLock);
+    len = !signatureZeroStart && holesMapped && findDirtyChunk(index) == NULL && rangeIsHole(start, CHUNK_SIZE);
+    pthread_mutex_unlock(&cacheLock);
+    if (len) return 0;
+
+    len = peekBuffer(start, data, CHUNK_SIZE + signatureMaxLength - 1);
+
+    /* each of the SIGNATURE_LANES lanes walks its own span of the chunk from the root, and on past the end of it
+     * far enough to finish what started inside. The walks don't depend on each other, so their table lookups overlap */
+    steps = span + signatureMaxLength - 1;
+    common = len - (SIGNATURE_LANES - 1) * span;
+    if (common < 0) common = 0;
+    if (common > steps) common = steps;
+    UNROLL(SIGNATURE_LANES)
+    for (lane = 0; lane < SIGNATURE_LANES; lane++)
+    {
+        entry[lane] = 0;
+    }
+    for (i = 0; i < common; i++)
+    {
+        /* unrolled, so every lane stays in a register and their lookups overlap*/
+        seen = 0;
+        UNROLL(SIGNATURE_LANES)
+        for (lane = 0; lane < SIGNATURE_LANES; lane++)
+        {
+            entry[lane] = acTable[(entry[lane] & ~AC_MATCH) + acClass[data[lane * span + i]]];
+            seen |= entry[lane];
+        }
+        if (!(seen & AC_MATCH)) continue;
+
+        UNROLL(SIGNATURE_LANES)
+        for (lane = 0; lane < SIGNATURE_LANES; lane++)
+        {
+            end = lane == SIGNATURE_LANES - 1 ? CHUNK_SIZE : (lane + 1) * span;
+            if (entry[lane] & AC_MATCH) count = reportHits(entry[lane], lane * span + i, lane * span, end, start, &hits, count, &capacity);
+        }
+    }
+
+    /* whatever each lane has left, which is all of it for a short chunk at the end of the buffer. The last lane
+     * also takes whatever is left over when SIGNATURE_LANES doesn't divide CHUNK_SIZE*/
+    UNROLL(SIGNATURE_LANES)
+    for (lane = 0; lane < SIGNATURE_LANES; lane++)
+    {
+        end = lane == SIGNATURE_LANES - 1 ? CHUNK_SIZE : (lane + 1) * span;
+        for (i = lane * span + common; i < end + signatureMaxLength - 1 && i < len; i++)
+        {
+            entry[lane] = acTable[(entry[lane] & ~AC_MATCH) + acClass[data[i]]];
+            if (entry[lane] & AC_MATCH) count = reportHits(entry[lane], i, lane * span, end, start, &hits, count, &capacity);
+        }
+    }
+
+    /* found at their ends and out of order, listed by their starts*/
+    qsort(hits, count, sizeof(SignatureHit), compareHits);
+    *found = hits;
+    return count;
+}
+
+int compareHits(const void * a, const void * b)
+{
+    const SignatureHit * x = a;
+    const SignatureHit * y = b;
+    if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    return x->signature - y->signature;
+}
+
+/* Scan thread, same scheme as stringsWorker. */
+void * signaturesWorker(void * arg)
+{
+    unsigned char * data = malloc(CHUNK_SIZE + SIGNATURE_MAX_LENGTH);
+    SignatureHit * found;
+    unsigned int version;
+    long index;
+    int count;
+
+    if (data == NULL) return arg;
+
+    pthread_mutex_lock(&hitsLock);
+    while (hitsRunning)
+    {
+        for (index = hitsScanFrom; index < hitChunkCount && hitChunks[index].state != CHUNK_PENDING; index++);
+        if (index >= hitChunkCount)
+        {
+            hitsScanFrom = index;
+            pthread_cond_wait(&hitsCond, &hitsLock);
+            continue;
+        }
+        hitsScanFrom = index + 1;
+        hitChunks[index].state = CHUNK_SCANNING;
+        version = hitChunks[index].version;
+        pthread_mutex_unlock(&hitsLock);
+
+        count = scanSignaturesChunk(index, data, &found);
+
+        pthread_mutex_lock(&hitsLock);
+        if (!hitsRunning || index >= hitChunkCount || hitChunks[index].version != version)
+        {
+            free(found);
+            continue;
+        }
+        if (hitChunks[index].state != CHUNK_SCANNED)
+        {
+            hitsScanned++;
+            hitsFound += count;
+        }
+        else hitsFound += count - hitChunks[index].count;
+        free(hitChunks[index].hits);
+        hitChunks[index].hits = found;
+        hitChunks[index].count = count;
+        hitChunks[index].state = CHUNK_SCANNED;
+    }
+    pthread_mutex_unlock(&hitsLock);
+
+    free(data);
+    return arg;
+}
+
+/* Moves a (chunk, hit) position to the next or previous hit. Returns -1 at either end. Must hold hitsLock. */
+int stepHit(long * chunk, int * hit, int direction)
+{
+    long c = *chunk;
+
+    if (direction == DIRECTION_FORWARD && c < hitChunkCount && *hit + 1 < hitChunks[c].count)
+    {
+        (*hit)++;
+        return 0;
+    }
+    if (direction == DIRECTION_BACKWARD && c < hitChunkCount && *hit > 0 && *hit <= hitChunks[c].count)
+    {
+        (*hit)--;
+        return 0;
+    }
+    for (c += direction; c >= 0 && c < hitChunkCount; c += direction)
+    {
+        if (hitChunks[c].count > 0)
+        {
+            *chunk = c;
+            *hit = direction == DIRECTION_FORWARD ? 0 : hitChunks[c].count - 1;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Sets marks[i] for every byte in [start, end) that is part of a hit, for drawEditorWin. */
+void markHits(long start, long end, char * marks)
+{
+    long c, first;
+    int i;
+
+    if (hitChunks == NULL || end <= start) return;
+
+    pthread_mutex_lock(&hitsLock);
+    first = (start > signatureMaxLength ? start - signatureMaxLength : 0) / CHUNK_SIZE;
+    for (c = first; c < hitChunkCount && c * CHUNK_SIZE < end; c++)
+    {
+        for (i = 0; i < hitChunks[c].count; i++)
+        {
+            long from = hitChunks[c].hits[i].offset;
+            long to = from + signatures[hitChunks[c].hits[i].signature].length;
+            if (to <= start || from >= end) continue;
+            if (from < start) from = start;
+            if (to > end) to = end;
+            memset(marks + from - start, 1, to - from);
+        }
+    }
+    pthread_mutex_unlock(&hitsLock);
+}
+
+/* The signature hits list, drawn over the editor like the strings list. Asks for a signature file if none is loaded.
+ * Up/Down/PgUp/PgDn pick a hit, Enter jumps to it, 'l' loads another signature file, 'q' closes. */
+void signaturesPanel()
+{
+    SignatureHit visible[STRINGS_PANEL_ROWS];
+    long selChunk, topChunk;
+    int selEntry, topEntry;
+    int selRow = 0, rows, shown, row, i, ch, step, done = 0;
+
+    if (signatureCount == 0)
+    {
+        sprintf(userOutput, "Signature file:");
+        inputPopup(userOutput);
+        if (exitSignal) return;
+        if (strlen(userInput) == 0 || loadSignatures(userInput)) return;
+    }
+    if (startSignatures())
+    {
+        sprintf(userOutput, "Error: Couldn't start the signature scan.");
+        return;
+    }
+
+    /* start on the first hit at or after the cursor*/
+    selChunk = curBufPos / CHUNK_SIZE;
+    selEntry = 0;
+    pthread_mutex_lock(&hitsLock);
+    if (selChunk < hitChunkCount)
+    {
+        while (selEntry < hitChunks[selChunk].count && hitChunks[selChunk].hits[selEntry].offset < curBufPos) selEntry++;
+    }
+    pthread_mutex_unlock(&hitsLock);
+
+    while (!done)
+    {
+        rows = getmaxy(editorWin);
+        if (rows > STRINGS_PANEL_ROWS) rows = STRINGS_PANEL_ROWS;
+        if (selRow >= rows) selRow = rows - 1; /* the terminal got shorter*/
+
+        pthread_mutex_lock(&hitsLock);
+        if (selChunk >= hitChunkCount) selChunk = hitChunkCount ? hitChunkCount - 1 : 0;
+        if (selChunk < hitChunkCount && selEntry >= hitChunks[selChunk].count)
+        {
+            selEntry = hitChunks[selChunk].count;
+            if (stepHit(&selChunk, &selEntry, DIRECTION_FORWARD)) stepHit(&selChunk, &selEntry, DIRECTION_BACKWARD);
+        }
+        topChunk = selChunk;
+        topEntry = selEntry;
+        for (i = 0; i < selRow && stepHit(&topChunk, &topEntry, DIRECTION_BACKWARD) == 0; i++);
+        selRow = i;
+        shown = 0;
+        if (topChunk < hitChunkCount && topEntry < hitChunks[topChunk].count)
+        {
+            do
+            {
+                visible[shown++] = hitChunks[topChunk].hits[topEntry];
+            }
+            while (shown < rows && stepHit(&topChunk, &topEntry, DIRECTION_FORWARD) == 0);
+        }
+        sprintf(userOutput, "Signatures: %d loaded, %ld hits, %ld%% scanned. Enter jumps, 'l' loads, 'q' closes",
+                signatureCount, hitsFound, hitChunkCount ? hitsScanned * 100 / hitChunkCount : 100);
+        pthread_mutex_unlock(&hitsLock);
+
+        werase(editorWin);
+        for (row = 0; row < shown; row++)
+        {
+            Signature * sig = &signatures[visible[row].signature];
+            if (row == selRow) wattron(editorWin, A_REVERSE);
+            wmove(editorWin, row, 0);
+            wattron(editorWin, A_BOLD);
+            wprintw(editorWin, "0x%0*lX", offsetDigits(), visible[row].offset);
+            wattroff(editorWin, A_BOLD);
+            wprintw(editorWin, " %c %-16s %c ", SEPARATOR, sig->name, SEPARATOR);
+            for (i = 0; i < sig->length && getcurx(editorWin) < getmaxx(editorWin) - 3; i++)
+            {
+                wprintw(editorWin, "%02x", sig->bytes[i]);
+            }
+            if (row == selRow) wattroff(editorWin, A_REVERSE);
+        }
+        wnoutrefresh(editorWin);
+        drawUserWin();
+        refreshScreen();
+
+        ch = getch();
+        if (exitSignal) break; /* closes the list, the main loop does the rest*/
+        step = 0;
+        if (ch == KEY_DOWN) step = 1;
+        else if (ch == KEY_UP) step = -1;
+        else if (ch == KEY_NPAGE) step = rows;
+        else if (ch == KEY_PPAGE) step = -rows;
+        else if ((ch == '\n' || ch == KEY_ENTER) && shown > 0)
+        {
+            int direction = visible[selRow].offset < curBufPos ? DIRECTION_BACKWARD : DIRECTION_FORWARD;
+            curBufPos = visible[selRow].offset;
+            curBufPosHalf = 0;
+            requestPrefetch(direction);
+            sprintf(userOutput, "Moved cursor to %.200s", signatures[visible[selRow].signature].name);
+            done = 1;
+        }
+        else if (ch == 'l')
+        {
+            sprintf(userOutput, "Signature file:");
+            inputPopup(userOutput);
+            if (exitSignal) break;
+            if (strlen(userInput) > 0)
+            {
+                if (loadSignatures(userInput)) return;
+                if (startSignatures())
+                {
+                    sprintf(userOutput, "Error: Couldn't start the signature scan.");
+                    return;
+                }
+            }
+        }
+        else if (ch == KEY_RESIZE)
+        {
+            resizeScreen();
+        }
+        else if (ch == 'q' || ch == 'F' || ch == 27)
+        {
+            sprintf(userOutput, "Closed signature hits");
+            done = 1;
+        }
+
+        pthread_mutex_lock(&hitsLock);
+        for (; step > 0 && stepHit(&selChunk, &selEntry, DIRECTION_FORWARD) == 0; step--)
+        {
+            if (selRow < rows - 1) selRow++;
+        }
+        for (; step < 0 && stepHit(&selChunk, &selEntry, DIRECTION_BACKWARD) == 0; step++)
+        {
+            if (selRow > 0) selRow--;
+        }
+        pthread_mutex_unlock(&hitsLock);
+    }
+}
+
+/* Reads a pattern typed by the user or found in a signature file: hex bytes (spaces allowed) up to the end of
+ * the line or a '#', or "quoted text". Returns the length, or -1 if it isn't one or is longer than max. */
+int parsePattern(const char * text, unsigned char * dest, int max)
+{
+    int length = 0, digit, high = -1;
+    const char * p = text;
+
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '"')
+    {
+        for (p++; *p && *p != '"'; p++)
+        {
+            if (length == max) return -1;
+            dest[length++] = *p;
+        }
+        return *p == '"' ? length : -1;
+    }
+    for (; *p && *p != '\n' && *p != '\r' && *p != '#'; p++)
+    {
+        if (*p == ' ' || *p == '\t') continue;
+        digit = hexValue(*p);
+        if (digit < 0 || (high < 0 && length == max)) return -1;
+        if (high < 0) high = digit;
+        else
+        {
+            dest[length++] = (high << 4) | digit;
+            high = -1;
+        }
+    }
+    return high >= 0 ? -1 : length;
+}
+
+/* The first position at or after pos that isn't in an untouched hole, or bufferLength if there isn't one.
+ * Must hold cacheLock. */
+unsigned long skipHoles(unsigned long pos)
+{
+    long next;
+    int low = 0, high = dirtyChunkCount, mid;
+
+    if (pos >= bufferLength || !rangeIsHole(pos, 1)) return pos;
+    next = holesMapped ? nextDataOffset(pos, DIRECTION_FORWARD) : -1;
+    if (next < 0 || next > bufferLength) next = bufferLength;
+
+    /* an edit in the hole counts as data too*/
+    while (low < high)
+    {
+        mid = (low + high) / 2;
+        if ((dirtyChunks[mid].index + 1) * CHUNK_SIZE <= pos) low = mid + 1;
+        else high = mid;
+    }
+    if (low < dirtyChunkCount && dirtyChunks[low].index * CHUNK_SIZE < next)
+    {
+        next = dirtyChunks[low].index * CHUNK_SIZE;
+        if (next < pos) next = pos;
+    }
+    return next;
+}
+
+/* Finds the first match of pattern starting at or after from, or -1. block holds STREAM_BUFFER_SIZE bytes of the
+ * buffer from *blockStart and is refilled as the search moves along, so a run of calls makes one pass over the file.
+ * Holes are skipped unless the pattern is all zeros. Set *blockLength to 0 to start fresh. */
+long findPattern(unsigned long from, const unsigned char * pattern, int len, unsigned char * block, unsigned long * blockStart, long * blockLength)
+{
+    unsigned char * hit;
+    unsigned long next;
+
+    while (len > 0 && from + len <= bufferLength)
+    {
+        if (*blockLength == 0 || from < *blockStart || from + len > *blockStart + *blockLength)
+        {
+            if (!isZeroBlock(pattern, len))
+            {
+                /* a match can still start in the zeros just before the data*/
+                pthread_mutex_lock(&cacheLock);
+                next = skipHoles(from);
+                pthread_mutex_unlock(&cacheLock);
+                if (next >= bufferLength) return -1;
+                if (next > from + len - 1) from = next - (len - 1);
+            }
+            *blockStart = from;
+            *blockLength = peekBuffer(from, block, STREAM_BUFFER_SIZE);
+            if (*blockLength < len) return -1;
+        }
+        hit = memmem(block + (from - *blockStart), *blockLength - (from - *blockStart), pattern, len);
+        if (hit != NULL) return *blockStart + (hit - block);
+        if (*blockStart + *blockLength >= bufferLength) return -1;
+        /* carry on from where a match could still be cut off by the end of the block*/
+        from = *blockStart + *blockLength - len + 1;
+    }
+    return -1;
+}
+
+/* Copies len bytes into the buffer at pos, the way fillBuffer does. */
+void writeBuffer(unsigned long pos, const unsigned char * src, unsigned long len)
+{
+    DirtyChunk * chunk;
+    unsigned long count;
+    unsigned long start = pos;
+
+    if (pos >= bufferLength) return;
+    len = leastOf(len, bufferLength - pos);
+    while (len > 0)
+    {
+        chunk = getDirtyChunk(pos / CHUNK_SIZE);
+        if (chunk == NULL) return;
+        count = leastOf(CHUNK_SIZE - (pos % CHUNK_SIZE), len);
+        pthread_mutex_lock(&cacheLock);
+        memcpy(chunk->data + (pos % CHUNK_SIZE), src, count);
+        pthread_mutex_unlock(&cacheLock);
+        src += count;
+        pos += count;
+        len -= count;
+    }
+    markStringsStale(start, pos - start);
+    markSignaturesStale(start, pos - start);
+    journalEdit(start, pos - start, 0);
+}
+
+double secondsSince(struct timespec * start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* '/' - finds the next match after the cursor, wrapping round to the top. An empty pattern repeats the last one. */
+void findNext()
+{
+    unsigned char * block;
+    unsigned long blockStart = 0;
+    long blockLength = 0, found;
+    struct timespec started;
+    int wrapped = 0;
+
+    sprintf(userOutput, "Find (hex or \"text\"):");
+    inputPopup(userOutput);
+    if (exitSignal) return;
+    if (strlen(userInput) > 0)
+    {
+        int len = parsePattern(userInput, searchPattern, SIGNATURE_MAX_LENGTH);
+        if (len <= 0)
+        {
+            sprintf(userOutput, "Error: Bad pattern, use hex bytes or \"text\".");
+            return;
+        }
+        searchLength = len;
+    }
+    if (searchLength == 0)
+    {
+        sprintf(userOutput, "Error: Nothing to find.");
+        return;
+    }
+    block = malloc(STREAM_BUFFER_SIZE);
+    if (block == NULL)
+    {
+        sprintf(userOutput, "Error: Out of memory.");
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    found = findPattern(curBufPos + 1, searchPattern, searchLength, block, &blockStart, &blockLength);
+    if (found < 0)
+    {
+        wrapped = 1;
+        blockLength = 0;
+        found = findPattern(0, searchPattern, searchLength, block, &blockStart, &blockLength);
+    }
+    free(block);
+
+    if (found < 0)
+    {
+        matchOffset = -1;
+        sprintf(userOutput, "Not found (%.0f MB/s)", bufferLength / 1e6 / secondsSince(&started));
+        return;
+    }
+    requestPrefetch(found < curBufPos ? DIRECTION_BACKWARD : DIRECTION_FORWARD);
+    curBufPos = found;
+    curBufPosHalf = 0;
+    matchOffset = found;
+    matchLength = searchLength;
+    sprintf(userOutput, "Found at 0x%lX%s", found, wrapped ? ", wrapped to the top" : "");
+}
+
+/* Draws a match and asks what to do with it. Returns the key pressed. */
+int askReplace(unsigned long pos)
+{
+    struct timespec asked;
+    int ch;
+    clock_gettime(CLOCK_MONOTONIC, &asked);
+    curBufPos = pos;
+    curBufPosHalf = 0;
+    matchOffset = pos;
+    matchLength = searchLength;
+    sprintf(userOutput, "Replace this one? 'y'es 'n'o 'a'll the rest 'q'uit");
+    timeout(-1);
+    do
+    {
+        drawUserWin();
+        drawEditorWin();
+        refreshScreen();
+        ch = getch();
+        if (ch == KEY_RESIZE) resizeScreen();
+    }
+    while (ch == KEY_RESIZE || (ch == ERR && !exitSignal));
+    timeout(250);
+    replaceWaited += secondsSince(&asked);
+    return exitSignal ? 'q' : ch;
+}
+
+/* Adds len bytes from src to the replace output, handing them to the file STREAM_BUFFER_SIZE at a time.
+ * A src of NULL copies that many bytes of the buffer from *copyFrom instead. Returns -1 on a write error. */
+int appendOutput(int fd, unsigned char * out, long * outFill, unsigned long * outPos, const unsigned char * src, unsigned long len, unsigned long * copyFrom)
+{
+    unsigned long count;
+
+    while (len > 0)
+    {
+        if (*outFill == STREAM_BUFFER_SIZE)
+        {
+            if (writeSparse(fd, out, *outFill, *outPos, 0)) return -1;
+            *outPos += *outFill;
+            *outFill = 0;
+        }
+        count = leastOf(len, STREAM_BUFFER_SIZE - *outFill);
+        if (src != NULL)
+        {
+            memcpy(out + *outFill, src, count);
+            src += count;
+        }
+        else
+        {
+            count = peekBuffer(*copyFrom, out + *outFill, count);
+            if (count == 0) return -1;
+            *copyFrom += count;
+        }
+        *outFill += count;
+        len -= count;
+    }
+    return 0;
+}
+
+/* Streams the whole file into outName with the matches from start on replaced along the way. Memory use is a
+ * couple of STREAM_BUFFER_SIZE blocks however big the file is. Returns the number replaced, or -1 on error. */
+long replaceToFile(const char * outName, const unsigned char * replacement, int replacementLength, int interactive, unsigned long start)
+{
+    unsigned char * block = malloc(STREAM_BUFFER_SIZE);
+    unsigned char * out = malloc(STREAM_BUFFER_SIZE);
+    unsigned long blockStart = 0, outPos = 0, copied = 0;
+    long blockLength = 0, outFill = 0, found, count = 0;
+    unsigned long from = start;
+    int fd, ch, failed = 0;
+
+    fd = open(outName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || block == NULL || out == NULL)
+    {
+        if (fd >= 0) close(fd);
+        free(block);
+        free(out);
+        return -1;
+    }
+
+    while (!failed && (found = findPattern(from, searchPattern, searchLength, block, &blockStart, &blockLength)) >= 0)
+    {
+        if (interactive)
+        {
+            ch = askReplace(found);
+            if (ch == 'q' || ch == 27) break;
+            if (ch == 'a') interactive = 0;
+            else if (ch != 'y')
+            {
+                from = found + 1;
+                continue;
+            }
+        }
+        /* everything up to the match as it is, then the replacement in place of it*/
+        failed = appendOutput(fd, out, &outFill, &outPos, NULL, found - copied, &copied)
+                 || appendOutput(fd, out, &outFill, &outPos, replacement, replacementLength, NULL);
+        copied = from = found + searchLength;
+        count++;
+    }
+    if (!failed) failed = appendOutput(fd, out, &outFill, &outPos, NULL, bufferLength - copied, &copied);
+    if (!failed) failed = writeSparse(fd, out, outFill, outPos, 0);
+    if (!failed) failed = ftruncate(fd, outPos + outFill) != 0;
+    if (close(fd) != 0) failed = 1;
+    free(block);
+    free(out);
+    return failed ? -1 : count;
+}
+
+/* Opens the file again after it has been replaced underneath us, starting the buffer over from what's on disk. */
+int reloadFile()
+{
+    FILE * reopened = fopen(filename, "r");
+    struct stat fileStat;
+
+    if (reopened == NULL || fstat(fileno(reopened), &fileStat) != 0)
+    {
+        if (reopened != NULL) fclose(reopened);
+        return -1;
+    }
+    stopStrings();
+    stopSignatures();
+    pthread_mutex_lock(&cacheLock);
+    /* the edits went into the new file along with everything else*/
+    while (dirtyChunkCount > 0)
+    {
+        free(dirtyChunks[--dirtyChunkCount].data);
+    }
+    if (fp != NULL) fclose(fp);
+    fp = reopened;
+    bufferLength = fileStat.st_size;
+    backingLength = bufferLength;
+    invalidateChunkCache();
+    pthread_mutex_unlock(&cacheLock);
+    mapHoles();
+
+    if (curBufPos >= bufferLength) curBufPos = bufferLength ? bufferLength - 1 : 0;
+    curBufPosHalf = 0;
+    while (bookmarkCount > 0 && bookmarks[bookmarkCount - 1] >= bufferLength) bookmarkCount--;
+    discardJournal();
+    bufferModified = 0;
+    if (signatureCount > 0) startSignatures();
+    return 0;
+}
+
+/* 'X' - replaces matches of a pattern, asking about each one or doing them all. Same length replacements asked
+ * about one at a time are made in the buffer like any other edit. Everything else, including the rest after an
+ * 'a'll, is streamed out to a file, which is reloaded if it's the one being edited, so replacing all of a huge
+ * file doesn't pull every chunk it touches into memory. */
+void replacePattern()
+{
+    unsigned char replacement[SIGNATURE_MAX_LENGTH];
+    char outName[BUFFER_LENGTH];
+    char tempName[BUFFER_LENGTH + 16];
+    unsigned char * block;
+    unsigned long blockStart = 0;
+    long blockLength = 0, found, count = 0;
+    unsigned long from, start = 0;
+    struct timespec started;
+    struct stat fileStat, outStat;
+    unsigned long scanned = bufferLength;
+    int len, replacementLength, interactive, sameFile, ch = 0;
+
+    sprintf(userOutput, "Replace (hex or \"text\"):");
+    inputPopup(userOutput);
+    if (exitSignal) return;
+    if (strlen(userInput) > 0)
+    {
+        len = parsePattern(userInput, searchPattern, SIGNATURE_MAX_LENGTH);
+        if (len <= 0)
+        {
+            sprintf(userOutput, "Error: Bad pattern, use hex bytes or \"text\".");
+            return;
+        }
+        searchLength = len;
+    }
+    if (searchLength == 0)
+    {
+        sprintf(userOutput, "Error: Nothing to replace.");
+        return;
+    }
+    sprintf(userOutput, "With (hex, \"text\" or \"\"):");
+    inputPopup(userOutput);
+    if (exitSignal) return;
+    replacementLength = parsePattern(userInput, replacement, SIGNATURE_MAX_LENGTH);
+    if (replacementLength < 0 || (replacementLength == 0 && strchr(userInput, '"') == NULL))
+    {
+        sprintf(userOutput, "Error: Bad replacement, use hex bytes, \"text\" or \"\" to delete.");
+        return;
+    }
+    sprintf(userOutput, "'i'nteractive or replace 'a'll?");
+    inputPopup(userOutput);
+    if (exitSignal) return;
+    if (userInput[0] != 'i' && userInput[0] != 'a')
+    {
+        sprintf(userOutput, "Replace cancelled.");
+        return;
+    }
+    interactive = userInput[0] == 'i';
+    replaceWaited = 0;
+
+    if (interactive && replacementLength == searchLength)
+    {
+        block = malloc(STREAM_BUFFER_SIZE);
+        if (block == NULL)
+        {
+            sprintf(userOutput, "Error: Out of memory.");
+            return;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        start = from = curBufPos;
+        while ((found = findPattern(from, searchPattern, searchLength, block, &blockStart, &blockLength)) >= 0)
+        {
+            from = found + 1;
+            ch = askReplace(found);
+            if (ch == 'q' || ch == 27 || ch == 'a') break;
+            if (ch != 'y') continue;
+            /* the block still has the old bytes, but the search has moved past them*/
+            writeBuffer(found, replacement, replacementLength);
+            from = found + searchLength;
+            count++;
+        }
+        free(block);
+        matchOffset = -1;
+        if (count > 0) bufferModified = 1;
+        if (ch != 'a')
+        {
+            /* a quit stops partway, so only count what the search got through*/
+            scanned = (found >= 0 ? blockStart + blockLength : bufferLength) - start;
+            sprintf(userOutput, "Replaced %ld, %.0f MB/s", count, scanned / 1e6 / (secondsSince(&started) - replaceWaited));
+            return;
+        }
+        /* the rest of them go the same way as replacing all from the start*/
+        start = found;
+        interactive = 0;
+    }
+
+    /* all of them, or a different length, has to go to a file*/
+    snprintf(outName, sizeof(outName), "%s", filename);
+    if (compressedInput) decompressedName(outName);
+    sprintf(userOutput, "Write to (enter for default):");
+    inputPopup(userOutput);
+    if (exitSignal) return;
+    if (strlen(userInput) > 0) snprintf(outName, sizeof(outName), "%s", userInput);
+    /* any other name for the open file, ./file or a link to it, is still the file being read*/
+    sameFile = strcmp(outName, filename) == 0;
+    if (!sameFile && fp != NULL && stat(outName, &outStat) == 0 && fstat(fileno(fp), &fileStat) == 0)
+    {
+        sameFile = outStat.st_dev == fileStat.st_dev && outStat.st_ino == fileStat.st_ino;
+    }
+    if (compressedInput && sameFile)
+    {
+        sprintf(userOutput, "Error: Can't write over the compressed file.");
+        return;
+    }
+
+    /* writing over the file being read goes through a temporary copy next to it, renamed over it at the end*/
+    snprintf(tempName, sizeof(tempName), "%s.binny-tmp", filename);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    replaceWaited = 0;
+    scanned = bufferLength;
+    found = replaceToFile(sameFile ? tempName : outName, replacement, replacementLength, interactive, start);
+    matchOffset = -1;
+    if (found < 0)
+    {
+        if (sameFile) unlink(tempName);
+        sprintf(userOutput, "Error: Couldn't write %.200s", outName);
+        return;
+    }
+    if (sameFile)
+    {
+        if (fp != NULL && fstat(fileno(fp), &fileStat) == 0) chmod(tempName, fileStat.st_mode & 07777);
+        if (rename(tempName, filename) != 0 || reloadFile() != 0)
+        {
+            unlink(tempName);
+            sprintf(userOutput, "Error: Couldn't replace %.200s", filename);
+            return;
+        }
+    }
+    count += found;
+    sprintf(userOutput, "Replaced %ld into %.150s, %.0f MB/s", count, outName, scanned / 1e6 / (secondsSince(&started) - replaceWaited));
+}
+
+/* Counts the bytes in data that equal the byte lag further on. */
+uint64_t countMatches(const unsigned char * data, long len, int lag)
+{
+    uint64_t total = 0;
+    long i = 0, n = len - lag;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i counts, sums;
+    int j;
+
+    while (i + 16 <= n)
+    {
+        /* each matching byte lane adds one, emptied out before 255 of them can wrap it*/
+        counts = zero;
+        for (j = 0; j < 255 && i + 16 <= n; j++, i += 16)
+        {
+            counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (data + i)),
+                                                         _mm_loadu_si128((const __m128i *) (data + i + lag))));
+        }
+        sums = _mm_sad_epu8(counts, zero);
+        total += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        total += data[i] == data[i + lag];
+    }
+    return total;
+}
+
+void * recordWorker(void * arg)
+{
+    RecordScan * scan = arg;
+    long block, from;
+    int lag;
+
+    for (block = scan->first; block < scan->blocks; block += scan->step)
+    {
+        unsigned char * data = scan->data + block * CHUNK_SIZE;
+        long len = scan->lengths[block];
+
+        /* every lag goes over one small piece before moving on, so it's read from L1 rather than L2*/
+        for (from = 0; from < len; from += RECORD_TILE)
+        {
+            for (lag = 1; lag <= scan->maxLag && from + lag < len; lag++)
+            {
+                scan->matches[lag] += countMatches(data + from, leastOf(RECORD_TILE, len - lag - from) + lag, lag);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Autocorrelates the bytes in [start, start + len) and returns the record length that stands out most,
+ * or 0 if none does. contrast is how far ahead of the average lag it came, as a fraction of the bytes. */
+long findRecordSize(unsigned long start, unsigned long len, double * contrast)
+{
+    RecordScan * scans;
+    pthread_t threads[STRINGS_MAX_THREADS];
+    unsigned char * data;
+    long lengths[RECORD_SAMPLE_BLOCKS];
+    long blocks, used = 0, threadCount, started, i, best = 0;
+    int maxLag, lag;
+    uint64_t matches, pairs;
+    double score[RECORD_MAX_PERIOD + 1], mean = 0;
+
+    *contrast = 0;
+    maxLag = leastOf(RECORD_MAX_PERIOD, leastOf(len, CHUNK_SIZE) / 2);
+    if (maxLag < 2) return 0;
+    blocks = leastOf((len + CHUNK_SIZE - 1) / CHUNK_SIZE, RECORD_SAMPLE_BLOCKS);
+    data = malloc(blocks * CHUNK_SIZE);
+    if (data == NULL) return -1;
+
+    /* whole range if it fits, otherwise blocks spread evenly across it. Blocks with nothing but zeros
+     * match at every lag and only water the answer down, so they're left out*/
+    for (i = 0; i < blocks; i++)
+    {
+        unsigned long from = start + (blocks > 1 && len > blocks * CHUNK_SIZE ? (len - CHUNK_SIZE) / (blocks - 1) * i : i * CHUNK_SIZE);
+        long n = peekBuffer(from, data + used * CHUNK_SIZE, leastOf(CHUNK_SIZE, start + len - from));
+        if (n > maxLag && !isZeroBlock(data + used * CHUNK_SIZE, n)) lengths[used++] = n;
+    }
+    if (used == 0)
+    {
+        free(data);
+        return 0;
+    }
+
+    threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    threadCount = threadCount < 1 ? 1 : leastOf(leastOf(threadCount, STRINGS_MAX_THREADS), used);
+    scans = calloc(threadCount, sizeof(RecordScan));
+    if (scans == NULL)
+    {
+        free(data);
+        return -1;
+    }
+    for (started = 0; started < threadCount; started++)
+    {
+        scans[started].data = data;
+        scans[started].lengths = lengths;
+        scans[started].blocks = used;
+        scans[started].first = started;
+        scans[started].step = threadCount;
+        scans[started].maxLag = maxLag;
+        if (started > 0 && pthread_create(&threads[started], NULL, recordWorker, &scans[started]) != 0) break;
+    }
+    /* this thread takes the first share, and whatever a thread that didn't start would have done*/
+    for (i = 0; i < threadCount; i++)
+    {
+        if (i == 0 || i >= started) recordWorker(&scans[i]);
+        else pthread_join(threads[i], NULL);
+    }
+
+    for (lag = 1; lag <= maxLag; lag++)
+    {
+        matches = 0;
+        pairs = 0;
+        for (i = 0; i < threadCount; i++) matches += scans[i].matches[lag];
+        for (i = 0; i < used; i++) pairs += lengths[i] - lag;
+        score[lag] = (double) matches / pairs;
+        if (lag >= 2)
+        {
+            mean += score[lag] / (maxLag - 1);
+            if (best == 0 || score[lag] > score[best]) best = lag;
+        }
+    }
+    free(scans);
+    free(data);
+
+    *contrast = score[best] - mean;
+    if (*contrast < RECORD_MIN_CONTRAST) return 0;
+    /* a record repeats at every multiple of its length too, so take the shortest one nearly as strong*/
+    for (lag = 2; lag < best; lag++)
+    {
+        if (best % lag == 0 && score[lag] - mean >= 0.8 * *contrast)
+        {
+            best = lag;
+            *contrast = score[lag] - mean;
+            break;
+        }
+    }
+    return best;
+}
+
+/* 'L', looks for fixed size records on screen or after the cursor and offers to line them up */
+void detectRecordSize()
+{
+    unsigned long start, len;
+    long period;
+    int rows, cols, group, width;
+    double contrast, elapsed;
+    struct timespec started;
+
+    getmaxyx(editorWin, rows, cols);
+    sprintf(userOutput, "Bytes to check [on screen]:");
+    inputPopup(userOutput);
+    if (exitSignal) return;
+    if (strlen(userInput) == 0)
+    {
+        start = topLineOfScreen * bytesPerLine;
+        len = leastOf(rows * bytesPerLine, bufferLength - start);
+    }
+    else if (strtol(userInput, NULL, 0) <= 0)
+    {
+        sprintf(userOutput, "Error: invalid number");
+        return;
+    }
+    else
+    {
+        start = curBufPos;
+        len = leastOf(strtol(userInput, NULL, 0), bufferLength - start);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    period = findRecordSize(start, len, &contrast);
+    elapsed = secondsSince(&started);
+    if (period < 0)
+    {
+        sprintf(userOutput, "Error: Out of memory.");
+        return;
+    }
+    if (period == 0)
+    {
+        sprintf(userOutput, "No record length stands out in 0x%lX bytes (%.2fs)", len, elapsed);
+        return;
+    }
+
+    /* keep the current grouping if it fits the record, otherwise the biggest that does*/
+    group = period % bytesPerGroup == 0 ? bytesPerGroup : period % 4 == 0 ? 4 : period % 2 == 0 ? 2 : period;
+    width = period * 2 + period / group + RIGHT_OFFSET + (showASCII ? period + 2 : 0);
+    sprintf(userOutput, "%ld byte records%s, use? [Y/n]", period, width > cols ? ", wide" : "");
+    inputPopup(userOutput);
+    if (exitSignal) return;
+    if (userInput[0] == 'n' || userInput[0] == 'N')
+    {
+        sprintf(userOutput, "Records look %ld (0x%lX) bytes long, %.0f%% above average (%.2fs)", period, period,
+                contrast * 100, elapsed);
+        return;
+    }
+    bytesPerLine = period;
+    bytesPerGroup = group;
+    /* lines still start from the top of the file, so the fields end up in columns if not at the left edge*/
+    topLineOfScreen = curBufPos / bytesPerLine;
+    handleScrolling();
+    sprintf(userOutput, "Lines are now %ld (0x%lX) bytes in groups of %d", period, period, group);
+}
+
+/* name needs room for BUFFER_LENGTH + 16 */
+void journalName(char * name)
+{
+    snprintf(name, BUFFER_LENGTH + 16, "%s%s", filename, JOURNAL_SUFFIX);
+}
+
+/* Notes an edit for the next autosave. This runs on every keystroke, so it only looks at the last edit
+ * to see if the two can be merged, the autosave sorts out the rest. */
+void journalEdit(unsigned long start, unsigned long length, int resize)
+{
+    JournalEdit * last;
+    JournalEdit * grown;
+
+    if (!journalRunning || (!resize && length == 0)) return;
+    pthread_mutex_lock(&journalLock);
+    last = journalEditCount > 0 ? &journalEdits[journalEditCount - 1] : NULL;
+    if (!resize && last != NULL && !last->resize && start <= last->start + last->length && start + length >= last->start)
+    {
+        unsigned long end = start + length > last->start + last->length ? start + length : last->start + last->length;
+        if (start < last->start) last->start = start;
+        last->length = end - last->start;
+    }
+    else
+    {
+        if (journalEditCount == journalEditCapacity)
+        {
+            grown = realloc(journalEdits, (journalEditCapacity ? journalEditCapacity * 2 : 256) * sizeof(JournalEdit));
+            if (grown == NULL)
+            {
+                journalFailed = 1;
+                pthread_mutex_unlock(&journalLock);
+                return;
+            }
+            journalEdits = grown;
+            journalEditCapacity = journalEditCapacity ? journalEditCapacity * 2 : 256;
+        }
+        journalEdits[journalEditCount].start = start;
+        journalEdits[journalEditCount].length = length;
+        journalEdits[journalEditCount].resize = resize;
+        journalEditCount++;
+    }
+    pthread_mutex_unlock(&journalLock);
+}
+
+int startJournal()
+{
+    journalRunning = 1;
+    if (pthread_create(&journalThread, NULL, journalWorker, NULL) != 0)
+    {
+        journalRunning = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* stops autosaving after one last one, so whatever was pending is in the journal*/
+void stopJournal()
+{
+    if (!journalRunning) return;
+    pthread_mutex_lock(&journalLock);
+    journalRunning = 0;
+    pthread_cond_signal(&journalCond);
+    pthread_mutex_unlock(&journalLock);
+    pthread_join(journalThread, NULL);
+
+    pthread_mutex_lock(&journalFileLock);
+    if (journalFd >= 0) close(journalFd);
+    journalFd = -1;
+    pthread_mutex_unlock(&journalFileLock);
+}
+
+/* the buffer matches the file on disk, so there's nothing left to recover*/
+void discardJournal()
+{
+    char name[BUFFER_LENGTH + 16];
+
+    if (journalInterval <= 0 || compressedInput) return;
+    pthread_mutex_lock(&journalFileLock);
+    pthread_mutex_lock(&journalLock);
+    journalEditCount = 0;
+    pthread_mutex_unlock(&journalLock);
+    if (journalFd >= 0) close(journalFd);
+    journalFd = -1;
+    journalName(name);
+    unlink(name);
+    pthread_mutex_unlock(&journalFileLock);
+}
+
+void pollJournal()
+{
+    if (journalFailed == 1)
+    {
+        sprintf(userOutput, "Error: Couldn't autosave to the recovery journal, edits since may not be recoverable.");
+        journalFailed = 2;
+    }
+}
+
+int compareJournalEdits(const void * a, const void * b)
+{
+    const JournalEdit * x = a;
+    const JournalEdit * y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* the file as it is on disk now, which the edits in the journal apply on top of*/
+void fillJournalHeader(unsigned char * header)
+{
+    struct stat fileStat;
+    uint64_t size = UINT64_MAX, seconds = 0, nanoseconds = 0;
+
+    if (stat(filename, &fileStat) == 0)
+    {
+        size = fileStat.st_size;
+        seconds = fileStat.st_mtim.tv_sec;
+        nanoseconds = fileStat.st_mtim.tv_nsec;
+    }
+    memcpy(header, JOURNAL_MAGIC, 8);
+    memcpy(header + 8, &size, 8);
+    memcpy(header + 16, &seconds, 8);
+    memcpy(header + 24, &nanoseconds, 8);
+}
+
+/* 'W' data at a, b bytes of it follow. 'L' resize to a. 'C' everything before here is complete */
+int writeJournalRecord(char type, unsigned long a, unsigned long b)
+{
+    unsigned char record[JOURNAL_RECORD_HEADER];
+    uint64_t first = a, second = b;
+
+    record[0] = type;
+    memcpy(record + 1, &first, 8);
+    memcpy(record + 9, &second, 8);
+    return writeFully(journalFd, record, JOURNAL_RECORD_HEADER);
+}
+
+/* Appends the bytes edited since last time to the journal and syncs it. Only the edited ranges are read,
+ * out of the dirty chunks, so this costs what was changed rather than what the file holds. */
+int flushJournal()
+{
+    JournalEdit * edits;
+    unsigned char * block = NULL;
+    unsigned char header[JOURNAL_HEADER];
+    char name[BUFFER_LENGTH + 16];
+    long count, from, i, j, k;
+    unsigned long pos, end, got;
+    off_t batchStart = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&journalFileLock);
+    pthread_mutex_lock(&journalLock);
+    edits = journalEdits;
+    count = journalEditCount;
+    journalEdits = NULL;
+    journalEditCount = 0;
+    journalEditCapacity = 0;
+    pthread_mutex_unlock(&journalLock);
+    if (count == 0)
+    {
+        pthread_mutex_unlock(&journalFileLock);
+        free(edits);
+        return 0;
+    }
+
+    if (journalFd < 0)
+    {
+        journalName(name);
+        journalFd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0600);
+        if (journalFd >= 0 && lseek(journalFd, 0, SEEK_END) == 0)
+        {
+            fillJournalHeader(header);
+            if (writeFully(journalFd, header, JOURNAL_HEADER)) ret = -1;
+        }
+    }
+    block = malloc(JOURNAL_BLOCK);
+    if (journalFd < 0 || block == NULL) ret = -1;
+    if (ret == 0) batchStart = lseek(journalFd, 0, SEEK_END);
+
+    /* writes between two resizes can be sorted and merged, but a resize has to stay where it happened*/
+    for (from = 0; from < count && ret == 0; from = i + 1)
+    {
+        for (i = from; i < count && !edits[i].resize; i++);
+        qsort(edits + from, i - from, sizeof(JournalEdit), compareJournalEdits);
+        for (j = from; j < i && ret == 0; j = k)
+        {
+            end = edits[j].start + edits[j].length;
+            for (k = j + 1; k < i && edits[k].start <= end; k++)
+            {
+                if (edits[k].start + edits[k].length > end) end = edits[k].start + edits[k].length;
+            }
+            /* the bytes as they are now, anything cut off by a later resize comes back short or not at all*/
+            for (pos = edits[j].start; pos < end && ret == 0; pos += got)
+            {
+                got = peekBuffer(pos, block, leastOf(JOURNAL_BLOCK, end - pos));
+                if (got == 0) break;
+                ret = writeJournalRecord('W', pos, got) || writeFully(journalFd, block, got);
+            }
+        }
+        if (i < count && ret == 0) ret = writeJournalRecord('L', edits[i].start, 0);
+    }
+    if (ret == 0) ret = writeJournalRecord('C', 0, 0);
+    if (ret == 0) ret = fsync(journalFd);
+    if (ret != 0)
+    {
+        /* leave the journal ending on the last complete batch, so later ones still follow on*/
+        if (journalFd >= 0 && ftruncate(journalFd, batchStart) != 0)
+        {
+            close(journalFd);
+            journalFd = -1;
+        }
+        if (journalFailed == 0) journalFailed = 1;
+    }
+    pthread_mutex_unlock(&journalFileLock);
+    free(block);
+    free(edits);
+    return ret;
+}
+
+void * journalWorker(void * arg)
+{
+    struct timespec wake;
+
+    pthread_mutex_lock(&journalLock);
+    while (journalRunning)
+    {
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += journalInterval;
+        pthread_cond_timedwait(&journalCond, &journalLock, &wake);
+        pthread_mutex_unlock(&journalLock);
+        flushJournal();
+        pthread_mutex_lock(&journalLock);
+    }
+    pthread_mutex_unlock(&journalLock);
+    flushJournal(); /* anything edited while the last one was being written*/
+    return NULL;
+}
+
+/* With limit -1, checks the records after the header and returns where the last complete batch ends.
+ * Otherwise applies the records up to limit and returns how many there were. */
+long replayJournal(int fd, long limit)
+{
+    unsigned char record[JOURNAL_RECORD_HEADER];
+    unsigned char * block = NULL;
+    struct stat journalStat;
+    long offset = JOURNAL_HEADER, committed = JOURNAL_HEADER, applied = 0;
+    uint64_t a, b;
+
+    if (fstat(fd, &journalStat) != 0 || lseek(fd, JOURNAL_HEADER, SEEK_SET) < 0) return -1;
+    if (limit >= 0 && (block = malloc(JOURNAL_BLOCK)) == NULL) return -1;
+    while ((limit < 0 || offset < limit) && readFully(fd, NULL, record, JOURNAL_RECORD_HEADER) == JOURNAL_RECORD_HEADER)
+    {
+        memcpy(&a, record + 1, 8);
+        memcpy(&b, record + 9, 8);
+        offset += JOURNAL_RECORD_HEADER;
+        if (record[0] == 'W')
+        {
+            if (b == 0 || b > JOURNAL_BLOCK || offset + b > journalStat.st_size) break;
+            if (limit < 0)
+            {
+                if (lseek(fd, b, SEEK_CUR) < 0) break;
+            }
+            else
+            {
+                if (readFully(fd, NULL, block, b) != b) break;
+                writeBuffer(a, block, b);
+            }
+            offset += b;
+            applied++;
+        }
+        else if (record[0] == 'L' && a > 0)
+        {
+            if (limit >= 0) resizeBuffer(a);
+            applied++;
+        }
+        else if (record[0] == 'C') committed = offset;
+        else break;
+    }
+    free(block);
+    return limit < 0 ? committed : applied;
+}
+
+/* at startup, if a journal was left behind, offers to put its edits back on top of the file*/
+void offerRecovery()
+{
+    char name[BUFFER_LENGTH + 16];
+    unsigned char header[JOURNAL_HEADER];
+    unsigned char current[JOURNAL_HEADER];
+    long committed, applied;
+    int fd, matches;
+
+    journalName(name);
+    fd = open(name, O_RDWR);
+    if (fd < 0) return;
+    if (readFully(fd, NULL, header, JOURNAL_HEADER) != JOURNAL_HEADER || memcmp(header, JOURNAL_MAGIC, 8) != 0)
+    {
+        close(fd);
+        journalInterval = 0;
+        sprintf(userOutput, "Error: %.150s isn't a recovery journal, autosave is off.", name);
+        return;
+    }
+    committed = replayJournal(fd, -1);
+    if (committed <= JOURNAL_HEADER)
+    {
+        close(fd);
+        unlink(name);
+        return;
+    }
+
+    fillJournalHeader(current);
+    matches = memcmp(header, current, JOURNAL_HEADER) == 0;
+    sprintf(userOutput, matches ? "Recover unsaved edits? [Y/n]" : "File changed, recover anyway? y/N");
+    inputPopup(userOutput);
+    if (exitSignal)
+    {
+        /* no answer either way, the journal stays for next time*/
+        close(fd);
+        return;
+    }
+    if (matches ?(userInput[0] == 'n' || userInput[0] == 'N') : (userInput[0] != 'y' && userInput[0] != 'Y'))
+    {
+        close(fd);
+        unlink(name);
+        sprintf(userOutput, "Discarded the recovery journal.");
+        return;
+    }
+
+    applied = replayJournal(fd, committed);
+    /* autosaving carries on in the same journal, minus any half written batch, and it's now
+     * relative to the file as it is*/
+    if (applied < 0 || ftruncate(fd, committed) != 0 || pwrite(fd, current, JOURNAL_HEADER, 0) != JOURNAL_HEADER)
+    {
+        sprintf(userOutput, "Error: Couldn't recover from %.150s", name);
+    }
+    else sprintf(userOutput, "Recovered %ld changes from %.150s, save to keep them.", applied, name);
+    close(fd);
+    if (applied > 0) bufferModified = 1;
+}
+
+uint64_t hashBytes(uint64_t hash, const void * data, long len)
+{
+    const unsigned char * bytes = data;
+    long i;
+
+    for (i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Sessions live in $XDG_CACHE_HOME/binny, or ~/.cache/binny, named after a hash of the file's full path. Puts the
+ * session's name in name (BUFFER_LENGTH + 32 long) and returns the full path, which the caller frees, or NULL
+ * if either can't be worked out. create makes the directories on the way. */
+char * sessionName(char * name, int create)
+{
+    char dir[BUFFER_LENGTH];
+    const char * base = getenv("XDG_CACHE_HOME");
+    char * path;
+    int n = -1;
+
+    if (base != NULL && base[0] == '/') n = snprintf(dir, sizeof(dir), "%s/%s", base, PROG_NAME);
+    else if (getenv("HOME") != NULL) n = snprintf(dir, sizeof(dir), "%s/.cache/%s", getenv("HOME"), PROG_NAME);
+    if (n < 0 || n >= sizeof(dir)) return NULL;
+    path = realpath(filename, NULL);
+    if (path == NULL) return NULL;
+
+    if (create)
+    {
+        /* the cache directory itself may not be there yet either*/
+        *strrchr(dir, '/') = '\0';
+        mkdir(dir, 0700);
+        dir[strlen(dir)] = '/';
+        mkdir(dir, 0700);
+    }
+    snprintf(name, BUFFER_LENGTH + 32, "%s/%016llx%s", dir, (unsigned long long) hashBytes(FNV_OFFSET, path, strlen(path)), SESSION_SUFFIX);
+    return path;
+}
+
+/* what a hits index was built from, the signatures' bytes in order. Their names can change without affecting it */
+uint64_t signaturesHash()
+{
+    uint64_t hash = FNV_OFFSET;
+    int i;
+
+    for (i = 0; i < signatureCount; i++)
+    {
+        hash = hashBytes(hash, &signatures[i].length, sizeof(signatures[i].length));
+        hash = hashBytes(hash, signatures[i].bytes, signatures[i].length);
+    }
+    return hash;
+}
+
+int writeSessionNumber(FILE * out, uint64_t value)
+{
+    return fwrite(&value, sizeof(value), 1, out) == 1 ? 0 : -1;
+}
+
+int readSessionNumber(FILE * in, uint64_t * value)
+{
+    return fread(value, sizeof(*value), 1, in) == 1 ? 0 : -1;
+}
+
+/* Bytes left in a session file. Every count read from it has to fit in what's left, so a damaged one can't ask
+ * for more memory than its own size. */
+long sessionRemaining(FILE * in)
+{
+    struct stat sessionStat;
+    long at = ftell(in);
+
+    if (at < 0 || fstat(fileno(in), &sessionStat) != 0 || sessionStat.st_size < at) return 0;
+    return sessionStat.st_size - at;
+}
+
+/* The strings index as an 'S', the minimum length and chunk count, then for each chunk its count plus one, or 0
+ * if it wasn't scanned, and its entries. Offsets are kept relative to the chunk, they all start inside it. */
+int saveStringsIndex(FILE * out)
+{
+    unsigned char entry[SESSION_ENTRY];
+    uint16_t offset;
+    uint32_t stored, length;
+    long c;
+    int i, failed;
+
+    if (stringsChunks == NULL) return 0;
+
+    pthread_mutex_lock(&stringsLock);
+    failed = fputc('S', out) == EOF || writeSessionNumber(out, stringsMinLength) || writeSessionNumber(out, stringsChunkCount);
+    for (c = 0; c < stringsChunkCount && !failed; c++)
+    {
+        stored = stringsChunks[c].state == CHUNK_SCANNED ? stringsChunks[c].count + 1 : 0;
+        failed = fwrite(&stored, sizeof(stored), 1, out) != 1;
+        for (i = 0; stored && i < stringsChunks[c].count && !failed; i++)
+        {
+            offset = stringsChunks[c].entries[i].offset - c * CHUNK_SIZE;
+            length = stringsChunks[c].entries[i].length | (stringsChunks[c].entries[i].wide ? 0x80000000u : 0);
+            memcpy(entry, &offset, 2);
+            memcpy(entry + 2, &length, 4);
+            failed = fwrite(entry, SESSION_ENTRY, 1, out) != 1;
+        }
+    }
+    pthread_mutex_unlock(&stringsLock);
+    return failed ? -1 : 0;
+}
+
+/* The hits index the same way, as an 'H' and a hash of the signatures it was built from */
+int saveHitsIndex(FILE * out)
+{
+    unsigned char entry[SESSION_ENTRY];
+    uint16_t offset;
+    uint32_t stored, signature;
+    long c;
+    int i, failed;
+
+    if (hitChunks == NULL) return 0;
+
+    pthread_mutex_lock(&hitsLock);
+    failed = fputc('H', out) == EOF || writeSessionNumber(out, signaturesHash()) || writeSessionNumber(out, hitChunkCount);
+    for (c = 0; c < hitChunkCount && !failed; c++)
+    {
+        stored = hitChunks[c].state == CHUNK_SCANNED ? hitChunks[c].count + 1 : 0;
+        failed = fwrite(&stored, sizeof(stored), 1, out) != 1;
+        for (i = 0; stored && i < hitChunks[c].count && !failed; i++)
+        {
+            offset = hitChunks[c].hits[i].offset - c * CHUNK_SIZE;
+            signature = hitChunks[c].hits[i].signature;
+            memcpy(entry, &offset, 2);
+            memcpy(entry + 2, &signature, 4);
+            failed = fwrite(entry, SESSION_ENTRY, 1, out) != 1;
+        }
+    }
+    pthread_mutex_unlock(&hitsLock);
+    return failed ? -1 : 0;
+}
+
+/* Reads a strings index written by saveStringsIndex, after its 'S'. It's only used if it was built with the
+ * same minimum length for a buffer this size, but is read through either way so the next section can be found.
+ * Returns -1 if the file ends early or has a count it couldn't hold. Called before anything could have started a scan. */
+int loadStringsIndex(FILE * in)
+{
+    unsigned char entry[SESSION_ENTRY];
+    uint64_t minLength, count;
+    uint16_t offset;
+    uint32_t stored, length;
+    StringsChunk * restored;
+    long c, scanned = 0, found = 0, remaining;
+    int i, failed;
+
+    if (readSessionNumber(in, &minLength) || readSessionNumber(in, &count)) return -1;
+    remaining = sessionRemaining(in);
+    if (count > bufferLength / CHUNK_SIZE + 1 || count * sizeof(stored) > remaining) return -1;
+    remaining -= count * sizeof(stored);
+    restored = calloc(count ? count : 1, sizeof(StringsChunk));
+    if (restored == NULL) return -1;
+
+    failed = 0;
+    for (c = 0; c < count && !failed; c++)
+    {
+        /* no more strings than bytes in a chunk*/
+        failed = fread(&stored, sizeof(stored), 1, in) != 1 || stored > CHUNK_SIZE + 1;
+        if (failed || stored == 0) continue;
+        failed = (stored - 1) * SESSION_ENTRY > remaining;
+        if (failed) continue;
+        remaining -= (stored - 1) * SESSION_ENTRY;
+        restored[c].entries = malloc(sizeof(StringEntry) * stored);
+        failed = restored[c].entries == NULL;
+        for (i = 0; i < stored - 1 && !failed; i++)
+        {
+            failed = fread(entry, SESSION_ENTRY, 1, in) != 1;
+            memcpy(&offset, entry, 2);
+            memcpy(&length, entry + 2, 4);
+            restored[c].entries[i].offset = c * CHUNK_SIZE + offset;
+            restored[c].entries[i].length = length & 0x7fffffff;
+            restored[c].entries[i].wide = (length & 0x80000000u) != 0;
+        }
+        restored[c].count = stored - 1;
+        restored[c].state = CHUNK_SCANNED;
+        scanned++;
+        found += restored[c].count;
+    }
+
+    if (failed || minLength != stringsMinLength || count != (bufferLength + CHUNK_SIZE - 1) / CHUNK_SIZE)
+    {
+        for (c = 0; c < count; c++) free(restored[c].entries);
+        free(restored);
+        return failed ? -1 : 0;
+    }
+    stringsChunks = restored;
+    stringsChunkCount = count;
+    stringsLength = bufferLength;
+    stringsScanFrom = 0;
+    stringsScanned = scanned;
+    stringsFound = found;
+    return 0;
+}
+
+/* Reads a hits index written by saveHitsIndex, after its 'H'. It's used if the same signatures are loaded now,
+ * which is also what keeps the signature numbers in it in range */
+int loadHitsIndex(FILE * in)
+{
+    unsigned char entry[SESSION_ENTRY];
+    uint64_t hash, count;
+    uint16_t offset;
+    uint32_t stored, signature;
+    HitChunk * restored;
+    long c, scanned = 0, found = 0, remaining, most;
+    int i, failed;
+
+    if (readSessionNumber(in, &hash) || readSessionNumber(in, &count)) return -1;
+    remaining = sessionRemaining(in);
+    if (count > bufferLength / CHUNK_SIZE + 1 || count * sizeof(stored) > remaining) return -1;
+    remaining -= count * sizeof(stored);
+    /* at most one hit for each signature starting at each byte, of the signatures it was saved with*/
+    most = (long) CHUNK_SIZE * (hash == signaturesHash() ? signatureCount : SIGNATURES_MAX);
+    restored = calloc(count ? count : 1, sizeof(HitChunk));
+    if (restored == NULL) return -1;
+
+    failed = 0;
+    for (c = 0; c < count && !failed; c++)
+    {
+        failed = fread(&stored, sizeof(stored), 1, in) != 1 || stored > most + 1;
+        if (failed || stored == 0) continue;
+        failed = (stored - 1) * SESSION_ENTRY > remaining;
+        if (failed) continue;
+        remaining -= (stored - 1) * SESSION_ENTRY;
+        restored[c].hits = malloc(sizeof(SignatureHit) * stored);
+        failed = restored[c].hits == NULL;
+        for (i = 0; i < stored - 1 && !failed; i++)
+        {
+            failed = fread(entry, SESSION_ENTRY, 1, in) != 1;
+            memcpy(&offset, entry, 2);
+            memcpy(&signature, entry + 2, 4);
+            restored[c].hits[i].offset = c * CHUNK_SIZE + offset;
+            restored[c].hits[i].signature = signature < signatureCount ? signature : 0;
+        }
+        restored[c].count = stored - 1;
+        restored[c].state = CHUNK_SCANNED;
+        scanned++;
+        found += restored[c].count;
+    }
+
+    if (failed || signatureCount == 0 || hash != signaturesHash() || count != (bufferLength + CHUNK_SIZE - 1) / CHUNK_SIZE)
+    {
+        for (c = 0; c < count; c++) free(restored[c].hits);
+        free(restored);
+        return failed ? -1 : 0;
+    }
+    hitChunks = restored;
+    hitChunkCount = count;
+    hitsLength = bufferLength;
+    hitsScanFrom = 0;
+    hitsScanned = scanned;
+    hitsFound = found;
+    return 0;
+}
+
+/* On the way out, saves where the cursor and view were, the layout, bookmarks, and the strings and hits indexes
+ * if they were built, so the next time the file is opened it's ready straight away. The indexes describe the
+ * buffer rather than the file, so they're only kept when there are no unsaved edits. */
+void saveSession()
+{
+    char name[BUFFER_LENGTH + 32];
+    char temp[BUFFER_LENGTH + 48];
+    char * path;
+    struct stat fileStat;
+    uint64_t key[6], view[6];
+    FILE * out;
+    int i, failed;
+
+    if (!sessionEnabled) return;
+    path = sessionName(name, 1);
+    if (path == NULL) return;
+    if (stat(path, &fileStat) != 0)
+    {
+        free(path);
+        return;
+    }
+    snprintf(temp, sizeof(temp), "%s.%d", name, (int) getpid());
+    out = fopen(temp, "wb");
+    if (out == NULL)
+    {
+        free(path);
+        return;
+    }
+
+    /* the session only applies to this very file, unchanged since*/
+    key[0] = fileStat.st_dev;
+    key[1] = fileStat.st_ino;
+    key[2] = fileStat.st_size;
+    key[3] = fileStat.st_mtim.tv_sec;
+    key[4] = fileStat.st_mtim.tv_nsec;
+    key[5] = strlen(path);
+    view[0] = curBufPos;
+    view[1] = topLineOfScreen;
+    view[2] = bytesPerLine;
+    view[3] = bytesPerGroup;
+    view[4] = showASCII;
+    view[5] = bookmarkCount;
+    failed = fwrite(SESSION_MAGIC, 8, 1, out) != 1 || fwrite(key, sizeof(key), 1, out) != 1 ||
+             fwrite(path, key[5], 1, out) != 1 || fwrite(view, sizeof(view), 1, out) != 1;
+    for (i = 0; i < bookmarkCount && !failed; i++)
+    {
+        failed = writeSessionNumber(out, bookmarks[i]);
+    }
+    if (!failed && !bufferModified) failed = saveStringsIndex(out) || saveHitsIndex(out);
+    if (fputc('E', out) == EOF) failed = 1;
+    if (fclose(out) != 0) failed = 1;
+
+    if (failed || rename(temp, name) != 0) unlink(temp);
+    free(path);
+}
+
+/* At startup, picks up the session left by saveSession if it was for this file as it is now. Has to come
+ * before anything starts scanning, the indexes it finds are handed to the scans to carry on with. */
+void loadSession()
+{
+    char name[BUFFER_LENGTH + 32];
+    char magic[8];
+    char * path;
+    char * savedPath;
+    struct stat fileStat;
+    uint64_t key[6], view[6], bookmark;
+    FILE * in;
+    int i, section;
+
+    sessionEnabled = 1;
+    path = sessionName(name, 0);
+    if (path == NULL) return;
+    in = fopen(name, "rb");
+    if (in == NULL || stat(path, &fileStat) != 0 || fread(magic, 8, 1, in) != 1 || memcmp(magic, SESSION_MAGIC, 8) != 0 ||
+        fread(key, sizeof(key), 1, in) != 1 || key[5] != strlen(path))
+    {
+        if (in != NULL) fclose(in);
+        free(path);
+        return;
+    }
+    savedPath = malloc(key[5] + 1);
+    if (savedPath == NULL || fread(savedPath, key[5], 1, in) != 1 || memcmp(savedPath, path, key[5]) != 0 ||
+        key[0] != fileStat.st_dev || key[1] != fileStat.st_ino || key[2] != fileStat.st_size ||
+        key[3] != fileStat.st_mtim.tv_sec || key[4] != fileStat.st_mtim.tv_nsec ||
+        fread(view, sizeof(view), 1, in) != 1 || view[5] > BOOKMARKS_MAX)
+    {
+        /* the file has changed since, or it's a different file. Saving on the way out replaces it*/
+        free(savedPath);
+        fclose(in);
+        free(path);
+        return;
+    }
+    free(savedPath);
+    free(path);
+
+    if (view[0] < bufferLength)
+    {
+        curBufPos = view[0];
+        if (!layoutFromOptions && view[2] > 0 && view[3] > 0 && view[3] <= view[2] && view[2] <= INT32_MAX)
+        {
+            bytesPerLine = view[2];
+            bytesPerGroup = view[3];
+            showASCII = view[4] != 0;
+            topLineOfScreen = view[1];
+        }
+        else topLineOfScreen = curBufPos / bytesPerLine;
+    }
+    for (i = 0; i < view[5] && readSessionNumber(in, &bookmark) == 0; i++)
+    {
+        if (bookmark < bufferLength) bookmarks[bookmarkCount++] = bookmark;
+    }
+
+    while ((section = fgetc(in)) != EOF && section != 'E')
+    {
+        if (section == 'S' && loadStringsIndex(in) == 0) continue;
+        if (section == 'H' && loadHitsIndex(in) == 0) continue;
+        /* a damaged session, so none of its indexes are trusted. The scans start over instead*/
+        stopStrings();
+        stopSignatures();
+        break;
+    }
+    fclose(in);
+    sprintf(userOutput, "Back where you left off%s%s.", stringsChunks != NULL ? ", strings index ready" : "",
+            hitChunks != NULL ? ", signature hits ready" : "");
+}
+
+/* 'M' - bookmarks the byte under the cursor, or takes the bookmark off if there is one*/
+void toggleBookmark()
+{
+    int i;
+
+    for (i = 0; i < bookmarkCount && bookmarks[i] < curBufPos; i++);
+    if (i < bookmarkCount && bookmarks[i] == curBufPos)
+    {
+        memmove(&bookmarks[i], &bookmarks[i + 1], sizeof(bookmarks[0]) * (bookmarkCount - i - 1));
+        bookmarkCount--;
+        sprintf(userOutput, "Removed the bookmark at 0x%lX", curBufPos);
+        return;
+    }
+    if (bookmarkCount == BOOKMARKS_MAX)
+    {
+        sprintf(userOutput, "Error: Already %d bookmarks, take one off with 'M' first.", BOOKMARKS_MAX);
+        return;
+    }
+    memmove(&bookmarks[i + 1], &bookmarks[i], sizeof(bookmarks[0]) * (bookmarkCount - i));
+    bookmarks[i] = curBufPos;
+    bookmarkCount++;
+    sprintf(userOutput, "Bookmarked 0x%lX (%d set), 'J' jumps to the next one", curBufPos, bookmarkCount);
+}
+
+/* 'J' - jumps to the next bookmark after the cursor, going round to the first after the last*/
+void nextBookmark()
+{
+    int i;
+
+    if (bookmarkCount == 0)
+    {
+        sprintf(userOutput, "No bookmarks, 'M' sets one at the cursor.");
+        return;
+    }
+    for (i = 0; i < bookmarkCount && bookmarks[i] <= curBufPos; i++);
+    if (i == bookmarkCount) i = 0;
+    curBufPos = bookmarks[i];
+    curBufPosHalf = 0;
+    requestPrefetch(DIRECTION_FORWARD);
+    sprintf(userOutput, "Bookmark %d of %d at 0x%lX", i + 1, bookmarkCount, curBufPos);
+}
+
+/* Works out a template type: u8 to u64 and i8 to i64, f32 and f64, with le or be on the end for byte order
+ * (le if it's left off), char for text, and bytes for anything to be shown as hex. Returns -1 if it isn't one. */
+int parseFieldType(const char * text, TemplateField * field)
+{
+    char * end;
+    long bits;
+
+    field->bigEndian = 0;
+    field->size = 1;
+    if (strcmp(text, "char") == 0) field->type = FIELD_CHAR;
+    else if (strcmp(text, "bytes") == 0) field->type = FIELD_BYTES;
+    else
+    {
+        if (text[0] == 'u') field->type = FIELD_UNSIGNED;
+        else if (text[0] == 'i') field->type = FIELD_SIGNED;
+        else if (text[0] == 'f') field->type = FIELD_FLOAT;
+        else return -1;
+        bits = strtol(text + 1, &end, 10);
+        if (strcmp(end, "be") == 0) field->bigEndian = 1;
+        else if (*end != 0 && strcmp(end, "le") != 0) return -1;
+        if (field->type == FIELD_FLOAT ? bits != 32 && bits != 64 : bits != 8 && bits != 16 && bits != 32 && bits != 64) return -1;
+        field->size = bits / 8;
+    }
+    return 0;
+}
+
+/* Reads a structure template, one field per line: a name, a type (see parseFieldType) and a count for arrays.
+ * Blank lines and lines starting with '#' are skipped, like a signature file. The fields follow on from each
+ * other to make up one record. Replaces the current template. Returns -1 with the reason in userOutput. */
+int loadTemplate(const char * path)
+{
+    FILE * in;
+    char line[BUFFER_LENGTH * 2];
+    char name[TEMPLATE_NAME_LENGTH], type[16], count[32];
+    TemplateField * loaded;
+    unsigned char * fieldAt;
+    int fields = 0, size = 0, nameWidth = 0, lineNumber = 0, failed = 0, i;
+    long n;
+
+    in = fopen(path, "r");
+    if (in == NULL)
+    {
+        sprintf(userOutput, "Error: Couldn't open %.200s", path);
+        return -1;
+    }
+    loaded = malloc(sizeof(TemplateField) * TEMPLATE_MAX_FIELDS);
+    if (loaded == NULL)
+    {
+        fclose(in);
+        sprintf(userOutput, "Error: Out of memory loading the template.");
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        TemplateField * field = &loaded[fields];
+        char * p = line;
+
+        lineNumber++;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0) continue;
+        if (fields == TEMPLATE_MAX_FIELDS)
+        {
+            sprintf(userOutput, "Error: More than %d fields in %.150s", TEMPLATE_MAX_FIELDS, path);
+            failed = 1;
+            break;
+        }
+        /* the widths are one short of the buffers above*/
+        n = sscanf(p, "%23s %15s %31s", name, type, count);
+        if (n < 2 || parseFieldType(type, field))
+        {
+            sprintf(userOutput, "Error: Bad field on line %d of %.150s", lineNumber, path);
+            failed = 1;
+            break;
+        }
+        field->count = n == 3 ? strtol(count, NULL, 0) : 1;
+        if (field->count < 1 || field->count > TEMPLATE_MAX_SIZE || size + field->size * field->count > TEMPLATE_MAX_SIZE)
+        {
+            sprintf(userOutput, "Error: Record longer than %d bytes on line %d of %.150s", TEMPLATE_MAX_SIZE, lineNumber, path);
+            failed = 1;
+            break;
+        }
+        snprintf(field->name, sizeof(field->name), "%s", name);
+        field->offset = size;
+        size += field->size * field->count;
+        if (strlen(name) > nameWidth) nameWidth = strlen(name);
+        fields++;
+    }
+    if (!failed && ferror(in))
+    {
+        sprintf(userOutput, "Error: Couldn't read %.200s", path);
+        failed = 1;
+    }
+    if (!failed && fields == 0)
+    {
+        sprintf(userOutput, "Error: No fields in %.200s", path);
+        failed = 1;
+    }
+    fclose(in);
+    fieldAt = failed ? NULL : malloc(size);
+    if (!failed && fieldAt == NULL)
+    {
+        sprintf(userOutput, "Error: Out of memory loading the template.");
+        failed = 1;
+    }
+    if (failed)
+    {
+        free(loaded);
+        return -1;
+    }
+
+    for (i = 0; i < fields; i++)
+    {
+        memset(fieldAt + loaded[i].offset, i, loaded[i].size * loaded[i].count);
+    }
+    free(templateFields);
+    free(templateFieldAt);
+    templateFields = loaded;
+    templateFieldCount = fields;
+    templateFieldAt = fieldAt;
+    templateSize = size;
+    templateNameWidth = nameWidth;
+    if (path != templateFile) snprintf(templateFile, sizeof(templateFile), "%s", path);
+    return 0;
+}
+
+/* how many whole records the overlay covers, which follows the buffer's length when it runs to the end*/
+long overlayRecordCount()
+{
+    long fit;
+
+    if (templateSize == 0 || overlayStart >= bufferLength) return 0;
+    fit = (bufferLength - overlayStart) / templateSize;
+    return overlayRecords >= 0 && overlayRecords < fit ? overlayRecords : fit;
+}
+
+/* how wide the overlay window should be, what's left beside the editor's lines within limits*/
+int overlayWidth()
+{
+    int cols = getmaxx(borderWin);
+    int lineCols = RIGHT_OFFSET + bytesPerLine * 2 + (bytesPerLine - 1) / bytesPerGroup + (showASCII ? bytesPerLine + 2 : 0);
+    int width = cols - 4 - lineCols;
+
+    if (width > OVERLAY_WIDTH) width = OVERLAY_WIDTH;
+    if (width < OVERLAY_MIN_WIDTH) width = OVERLAY_MIN_WIDTH;
+    if (width > (cols - 2) / 2) width = (cols - 2) / 2;
+    return width;
+}
+
+/* the colour a field is drawn in, or bold on every other field without colours*/
+int overlayAttr(int field)
+{
+    if (overlayColours) return COLOR_PAIR(field % OVERLAY_COLOURS + 1);
+    return field % 2 ? A_BOLD : A_NORMAL;
+}
+
+/* one element of a numeric field, in the field's byte order. Signed values are sign extended*/
+uint64_t fieldElement(const TemplateField * field, const unsigned char * data)
+{
+    uint64_t value = 0;
+    int i;
+
+    for (i = 0; i < field->size; i++)
+    {
+        value |= (uint64_t) data[field->bigEndian ? field->size - 1 - i : i] << (i * 8);
+    }
+    if (field->type == FIELD_SIGNED && field->size < 8 && (value >> (field->size * 8 - 1)) & 1)
+    {
+        value |= ~(uint64_t) 0 << (field->size * 8);
+    }
+    return value;
+}
+
+/* Decodes a field into text, at most width characters. Arrays that don't fit end in "..". */
+void formatField(const TemplateField * field, const unsigned char * data, char * text, int width)
+{
+    char piece[64];
+    uint64_t value;
+    uint32_t single;
+    float singleFloat;
+    double doubleFloat;
+    int used = 0, i, n;
+
+    text[0] = 0;
+    if (field->type == FIELD_CHAR)
+    {
+        for (i = 0; i < field->count && used < width; i++)
+        {
+            text[used++] = IS_STRING_CHAR(data[i]) && data[i] != '\t' ? data[i] : '.';
+        }
+        text[used] = 0;
+        return;
+    }
+    for (i = 0; i < field->count; i++)
+    {
+        value = fieldElement(field, data + i * field->size);
+        if (field->type == FIELD_BYTES) n = snprintf(piece, sizeof(piece), "%02x", data[i]);
+        else if (field->type == FIELD_SIGNED) n = snprintf(piece, sizeof(piece), "%lld", (long long) value);
+        else if (field->type == FIELD_FLOAT && field->size == 4)
+        {
+            single = value;
+            memcpy(&singleFloat, &single, 4);
+            n = snprintf(piece, sizeof(piece), "%g", singleFloat);
+        }
+        else if (field->type == FIELD_FLOAT)
+        {
+            memcpy(&doubleFloat, &value, 8);
+            n = snprintf(piece, sizeof(piece), "%g", doubleFloat);
+        }
+        /* a lone number gets its hex as well, there's no room for that in arrays*/
+        else if (field->count == 1) n = snprintf(piece, sizeof(piece), "%llu (0x%llX)", (unsigned long long) value, (unsigned long long) value);
+        else n = snprintf(piece, sizeof(piece), "%llu", (unsigned long long) value);
+
+        if (used + (i > 0) + n > width)
+        {
+            if (used + 2 <= width) strcpy(text + used, "..");
+            return;
+        }
+        used += sprintf(text + used, "%s%s", i > 0 ? " " : "", piece);
+    }
+}
+
+/* puts the overlay window up beside the editor, which is narrowed to make room*/
+void showOverlay()
+{
+    if (overlayWin == NULL)
+    {
+        overlayWin = newwin(1, 1, 1, 1);
+        leaveok(overlayWin, TRUE); /* the cursor stays in the editor*/
+    }
+    resizeScreen();
+}
+
+void hideOverlay()
+{
+    if (overlayWin == NULL) return;
+    delwin(overlayWin);
+    overlayWin = NULL;
+    resizeScreen();
+}
+
+/* The overlay window: which record the cursor is in and its fields decoded, with the one under the cursor
+ * picked out. Only that one record is read, however many there are. */
+void drawOverlayWin()
+{
+    unsigned char * record;
+    char value[OVERLAY_WIDTH + 1];
+    const char * name = strrchr(templateFile, '/') ? strrchr(templateFile, '/') + 1 : templateFile;
+    long records = overlayRecordCount(), index = 0;
+    int rows, cols, nameWidth, field = -1, first, row, i;
+
+    if (overlayWin == NULL) return;
+    /* the editor's lines changed length, 'L' or a longer offset*/
+    if (getmaxx(overlayWin) != overlayWidth()) resizeScreen();
+    werase(overlayWin);
+    getmaxyx(overlayWin, rows, cols);
+    nameWidth = templateNameWidth < cols / 2 ? templateNameWidth : cols / 2;
+
+    wattron(overlayWin, A_BOLD);
+    mvwprintw(overlayWin, 0, 0, "%.*s", cols, name);
+    wattroff(overlayWin, A_BOLD);
+    if (curBufPos >= overlayStart && curBufPos < overlayStart + records * templateSize)
+    {
+        index = (curBufPos - overlayStart) / templateSize;
+        field = templateFieldAt[(curBufPos - overlayStart) % templateSize];
+    }
+    mvwprintw(overlayWin, 1, 0, "%ld x %dB from 0x%lX", records, templateSize, overlayStart);
+    if (field < 0 || (record = malloc(templateSize)) == NULL)
+    {
+        mvwprintw(overlayWin, 2, 0, "%.*s", cols, records > 0 ? "Cursor is outside the records" : "No whole record fits");
+        wnoutrefresh(overlayWin);
+        return;
+    }
+    mvwprintw(overlayWin, 2, 0, "Record %ld at 0x%lX", index, overlayStart + index * templateSize);
+    readBuffer(overlayStart + index * templateSize, record, templateSize);
+
+    /* keep the field under the cursor in view when they don't all fit*/
+    first = field - (rows - 4) + 1;
+    if (first < 0) first = 0;
+    for (row = 4, i = first; row < rows && i < templateFieldCount; row++, i++)
+    {
+        formatField(&templateFields[i], record + templateFields[i].offset, value, cols - nameWidth - 1);
+        if (i == field) wattron(overlayWin, A_REVERSE);
+        wattron(overlayWin, overlayAttr(i));
+        mvwprintw(overlayWin, row, 0, "%-*.*s", nameWidth, nameWidth, templateFields[i].name);
+        wattroff(overlayWin, overlayAttr(i));
+        wprintw(overlayWin, " %s", value);
+        if (i == field) wattroff(overlayWin, A_REVERSE);
+    }
+    free(record);
+    wnoutrefresh(overlayWin);
+}
+
+/* 'O' - lays a structure template over the buffer from an offset, or takes it away if one is showing */
+void overlayInput()
+{
+    long start, records = -1;
+
+    if (overlayWin != NULL)
+    {
+        hideOverlay();
+        sprintf(userOutput, "Overlay closed, 'O' lays one down again.");
+        return;
+    }
+    sprintf(userOutput, templateFieldCount > 0 ? "Template file, empty for the last:" : "Template file:");
+    inputPopup(userOutput);
+    if (exitSignal) return;
+    if (strlen(userInput) > 0)
+    {
+        if (loadTemplate(userInput)) return;
+    }
+    else if (templateFieldCount == 0)
+    {
+        sprintf(userOutput, "Error: Empty string.");
+        return;
+    }
+
+    sprintf(userOutput, "Anchor at, empty for the cursor:");
+    inputPopup(userOutput);
+    if (exitSignal) return;
+    start = strlen(userInput) > 0 ? strtol(userInput, NULL, 0) : curBufPos;
+    if (start < 0 || start >= bufferLength)
+    {
+        sprintf(userOutput, "Error: invalid number");
+        return;
+    }
+    sprintf(userOutput, "Records, empty runs to the end:");
+    inputPopup(userOutput);
+    if (exitSignal) return;
+    if (strlen(userInput) > 0 && (records = strtol(userInput, NULL, 0)) <= 0)
+    {
+        sprintf(userOutput, "Error: invalid number");
+        return;
+    }
+
+    overlayStart = start;
+    overlayRecords = records;
+    showOverlay();
+    sprintf(userOutput, "%ld records of %d bytes from 0x%lX", overlayRecordCount(), templateSize, overlayStart);
+}
+
+/* Writes two lowercase hex digits for each of the n bytes in src. */
+void encodeHex(const unsigned char * src, long n, char * dest)
+{
+    static const char digits[] = "0123456789abcdef";
+    long i = 0;
+#ifdef __SSE2__
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zeroChar = _mm_set1_epi8('0');
+    const __m128i letterGap = _mm_set1_epi8('a' - '0' - 10);
+    __m128i v, high, low;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        v = _mm_loadu_si128((const __m128i *) (src + i));
+        high = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+        low = _mm_and_si128(v, nibble);
+        /* '0' + n, plus the gap up to 'a' for anything over 9*/
+        high = _mm_add_epi8(_mm_add_epi8(high, zeroChar), _mm_and_si128(_mm_cmpgt_epi8(high, nine), letterGap));
+        low = _mm_add_epi8(_mm_add_epi8(low, zeroChar), _mm_and_si128(_mm_cmpgt_epi8(low, nine), letterGap));
+        _mm_storeu_si128((__m128i *) (dest + 2 * i), _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i *) (dest + 2 * i + 16), _mm_unpackhi_epi8(high, low));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        dest[2 * i] = digits[src[i] >> 4];
+        dest[2 * i + 1] = digits[src[i] & 0x0f];
+    }
+}
+
+/* Copies the n bytes in src as they'd show in the ASCII column, printable ones as they are and the rest as dots. */
+void encodeAscii(const unsigned char * src, long n, char * dest)
+{
+    long i = 0;
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(0x1f);
+    const __m128i tilde = _mm_set1_epi8(0x7f);
+    const __m128i dot = _mm_set1_epi8('.');
+    __m128i v, printable;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        v = _mm_loadu_si128((const __m128i *) (src + i));
+        /* signed compares, so everything from 0x80 up is below the space too*/
+        printable = _mm_and_si128(_mm_cmpgt_epi8(v, space), _mm_cmplt_epi8(v, tilde));
+        _mm_storeu_si128((__m128i *) (dest + i), _mm_or_si128(_mm_and_si128(printable, v), _mm_andnot_si128(printable, dot)));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        dest[i] = (src[i] >= 0x20 && src[i] <= 0x7E) ? src[i] : '.';
+    }
+}
+
+/* Turns n pairs of hex digits, either case, into n bytes. Returns n, or -1 if anything isn't a hex digit. */
+long decodeHex(const char * src, long n, unsigned char * dest)
+{
+    long i = 0;
+    int high, low;
+#ifdef __SSE2__
+    const __m128i zeroChar = _mm_set1_epi8('0');
+    const __m128i letterA = _mm_set1_epi8('a');
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    const __m128i minusOne = _mm_set1_epi8(-1);
+    const __m128i ten = _mm_set1_epi8(10);
+    const __m128i six = _mm_set1_epi8(6);
+    const __m128i lowByte = _mm_set1_epi16(0x00ff);
+    __m128i v, digit, letter, isDigit, isLetter, value[2];
+    int half;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        for (half = 0; half < 2; half++)
+        {
+            v = _mm_loadu_si128((const __m128i *) (src + 2 * i + 16 * half));
+            /* signed compares again, anything 0x80 and up lands outside both ranges*/
+            digit = _mm_sub_epi8(v, zeroChar);
+            letter = _mm_sub_epi8(_mm_or_si128(v, caseBit), letterA);
+            isDigit = _mm_and_si128(_mm_cmpgt_epi8(digit, minusOne), _mm_cmplt_epi8(digit, ten));
+            isLetter = _mm_and_si128(_mm_cmpgt_epi8(letter, minusOne), _mm_cmplt_epi8(letter, six));
+            if (_mm_movemask_epi8(_mm_or_si128(isDigit, isLetter)) != 0xffff) return -1;
+            v = _mm_or_si128(_mm_and_si128(isDigit, digit), _mm_and_si128(isLetter, _mm_add_epi8(letter, ten)));
+            /* each 16 bit lane holds a high nibble then a low one*/
+            value[half] = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, lowByte), 4), _mm_srli_epi16(v, 8));
+        }
+        _mm_storeu_si128((__m128i *) (dest + i), _mm_packus_epi16(value[0], value[1]));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        high = hexValue(src[2 * i]);
+        low = hexValue(src[2 * i + 1]);
+        if (high < 0 || low < 0) return -1;
+        dest[i] = (high << 4) | low;
+    }
+    return n;
+}
+
+/* Counts the hex digits at the start of src, up to n of them, 16 at a time. */
+long hexRunLength(const char * src, long n)
+{
+    long run = 0;
+#ifdef __SSE2__
+    const __m128i zeroChar = _mm_set1_epi8('0');
+    const __m128i letterA = _mm_set1_epi8('a');
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    const __m128i minusOne = _mm_set1_epi8(-1);
+    const __m128i ten = _mm_set1_epi8(10);
+    const __m128i six = _mm_set1_epi8(6);
+    __m128i v, digit, letter;
+    unsigned mask;
+
+    for (; run + 16 <= n; run += 16)
+    {
+        v = _mm_loadu_si128((const __m128i *) (src + run));
+        digit = _mm_sub_epi8(v, zeroChar);
+        letter = _mm_sub_epi8(_mm_or_si128(v, caseBit), letterA);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_and_si128(_mm_cmpgt_epi8(digit, minusOne), _mm_cmplt_epi8(digit, ten)),
+                                              _mm_and_si128(_mm_cmpgt_epi8(letter, minusOne), _mm_cmplt_epi8(letter, six))));
+        if (mask != 0xffff) return run + __builtin_ctz(~mask);
+    }
+#endif
+    while (run < n && hexValue(src[run]) >= 0) run++;
+    return run;
+}
+
+int hexValue(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* Reads until len bytes have arrived or the input ends, through zlib when in is set. Returns the count or -1. */
+long readFully(int fd, gzFile in, unsigned char * dest, long len)
+{
+    long got = 0, ret;
+    while (got < len)
+    {
+        if (in != NULL) ret = gzread(in, dest + got, leastOf(len - got, 0x40000000));
+        else ret = read(fd, dest + got, len - got);
+        if (ret < 0 && in == NULL && errno == EINTR) continue;
+        if (ret < 0) return -1;
+        if (ret == 0) break;
+        got += ret;
+    }
+    return got;
+}
+
+int writeFully(int fd, const void * src, long len)
+{
+    long done = 0, ret;
+    while (done < len)
+    {
+        ret = write(fd, (const char *) src + done, len - done);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return -1;
+        done += ret;
+    }
+    return 0;
+}
+
+/* --dump. Streams the file to stdout laid out the way drawEditorWin shows it, a few MB at a time,
+ * so memory use doesn't depend on the file size. gzip input is decompressed unless -r is given.
+ * The hex and the text built from it are kept small enough to stay in cache, which is what bounds the speed. */
+int dumpFile()
+{
+    static const char hexDigits[] = "0123456789ABCDEF";
+    long lineCount = leastOf(STREAM_BUFFER_SIZE / bytesPerLine, STREAM_BUFFER_SIZE);
+    long sliceSize = leastOf(DUMP_SLICE / bytesPerLine, lineCount) * bytesPerLine;
+    long inSize, lineMax, outSize, n, i, out, count, lineStart, sliceStart, group, hexEnd, asciiCol;
+    long phase = 0, linePhase = bytesPerLine % bytesPerGroup;
+    unsigned char * inBuf;
+    char * hex;
+    char * outBuf;
+    char hexPairs[512];
+    char offsetText[16];
+    unsigned long offset = 0, shown = 0, changed;
+    struct stat fileStat;
+    int inFd, digits = 0, ret = 0;
+    gzFile in = NULL;
+
+    /* offsetText holds shown in all 16 digits, and only the bytes that change from line to line are redone*/
+    for (i = 0; i < 256; i++)
+    {
+        hexPairs[2 * i] = hexDigits[i >> 4];
+        hexPairs[2 * i + 1] = hexDigits[i & 0x0f];
+    }
+    memset(offsetText, '0', sizeof(offsetText));
+
+    if (lineCount < 1) lineCount = 1;
+    if (sliceSize < bytesPerLine) sliceSize = bytesPerLine;
+    inSize = lineCount * bytesPerLine;
+    /* header, two digits and at most one space per byte, the ASCII column and a newline*/
+    lineMax = 2 + 16 + 3 + bytesPerLine * 3 + 2 + bytesPerLine + 1;
+    outSize = lineMax * leastOf(lineCount, DUMP_OUTPUT / lineMax + 1);
+    asciiCol = (bytesPerLine * 2) + (bytesPerLine / bytesPerGroup) + ASCII_OFFSET;
+
+    inFd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (inFd < 0)
+    {
+        fprintf(stderr, "%s: Couldn't open %s.\n", PROG_NAME, filename);
+        return -1;
+    }
+    if (!showRaw)
+    {
+        in = gzdopen(inFd, "rb");
+        if (in != NULL) gzbuffer(in, STREAM_BUFFER_SIZE);
+    }
+    inBuf = malloc(inSize);
+    hex = malloc(sliceSize * 2);
+    outBuf = malloc(outSize);
+    if ((!showRaw && in == NULL) || inBuf == NULL || hex == NULL || outBuf == NULL)
+    {
+        fprintf(stderr, "%s: Out of memory.\n", PROG_NAME);
+        ret = -1;
+    }
+
+    while (ret == 0 && (n = readFully(inFd, in, inBuf, inSize)) > 0)
+    {
+        /* offsets as wide as the editor would show them for the whole file, when its size is known up front.
+         * A pipe or gzip input starts at the narrowest and widens as it passes each power of 16*/
+        if (digits == 0)
+        {
+            if ((in == NULL || gzdirect(in)) && fstat(inFd, &fileStat) == 0 && S_ISREG(fileStat.st_mode)) bufferLength = fileStat.st_size;
+            digits = offsetDigits();
+        }
+        out = 0;
+        sliceStart = -sliceSize;
+        for (lineStart = 0; ret == 0 && lineStart < n; lineStart += bytesPerLine)
+        {
+            count = leastOf(bytesPerLine, n - lineStart);
+            if (lineStart == sliceStart + sliceSize)
+            {
+                sliceStart = lineStart;
+                encodeHex(inBuf + sliceStart, leastOf(sliceSize, n - sliceStart), hex);
+            }
+            if (out + lineMax > outSize)
+            {
+                if (writeFully(STDOUT_FILENO, outBuf, out)) ret = -1;
+                out = 0;
+            }
+
+            outBuf[out++] = '0';
+            outBuf[out++] = 'x';
+            while (digits < 16 && (offset >> (digits * 4)) != 0) digits++;
+            for (i = 0, changed = offset ^ shown; changed != 0; i++, changed >>= 8)
+            {
+                memcpy(offsetText + 14 - 2 * i, hexPairs + 2 * ((offset >> (i * 8)) & 0xff), 2);
+            }
+            shown = offset;
+            memcpy(outBuf + out, offsetText + 16 - digits, digits);
+            out += digits;
+            outBuf[out++] = ' ';
+            outBuf[out++] = SEPARATOR;
+            outBuf[out++] = ' ';
+
+            /* groups break on whole multiples of bytesPerGroup, same as the editor. phase is offset % bytesPerGroup*/
+            hexEnd = out + asciiCol;
+            group = bytesPerGroup - phase;
+            for (i = 0; i < count; i += group, group = bytesPerGroup)
+            {
+                if (group > count - i) group = count - i;
+                if (i != 0) outBuf[out++] = ' ';
+                if (group == 4) memcpy(outBuf + out, hex + 2 * (lineStart - sliceStart + i), 8); /* the default, as one move*/
+                else memcpy(outBuf + out, hex + 2 * (lineStart - sliceStart + i), 2 * group);
+                out += 2 * group;
+            }
+
+            if (showASCII)
+            {
+                /* only a short last line needs padding out to the column*/
+                if (out < hexEnd)
+                {
+                    memset(outBuf + out, ' ', hexEnd - out);
+                    out = hexEnd;
+                }
+                outBuf[out++] = SEPARATOR;
+                outBuf[out++] = ' ';
+                encodeAscii(inBuf + lineStart, count, outBuf + out);
+                out += count;
+            }
+            outBuf[out++] = '\n';
+            offset += count;
+            phase += count == bytesPerLine ? linePhase : count % bytesPerGroup;
+            if (phase >= bytesPerGroup) phase -= bytesPerGroup;
+        }
+        if (ret != 0 || writeFully(STDOUT_FILENO, outBuf, out))
+        {
+            fprintf(stderr, "%s: Couldn't write the dump.\n", PROG_NAME);
+            ret = -1;
+        }
+        if (n < inSize) break;
+    }
+    if (ret == 0 && n < 0)
+    {
+        fprintf(stderr, "%s: Couldn't read %s.\n", PROG_NAME, filename);
+        ret = -1;
+    }
+
+    free(inBuf);
+    free(hex);
+    free(outBuf);
+    if (in != NULL) gzclose(in);
+    else if (inFd != STDIN_FILENO) close(inFd);
+    return ret;
+}
+
+/* Writes out what undump has decoded so far and empties it. Returns -1 if the write fails. */
+int flushUndump(const unsigned char * outBuf, long * outLen)
+{
+    if (*outLen > 0 && writeFully(STDOUT_FILENO, outBuf, *outLen))
+    {
+        fprintf(stderr, "%s: Couldn't write the output.\n", PROG_NAME);
+        return -1;
+    }
+    *outLen = 0;
+    return 0;
+}
+
+/* Decodes a line's hex laid out the way --dump writes it, groups of width digits split by single spaces and
+ * then only spaces up to the ASCII column or the end. They're gathered into lineHex, which needs 16 bytes of
+ * slack, and decoded with decodeHex in one go. Returns the number of bytes, or -1 if the line isn't like that. */
+long decodeGroups(const char * g, const char * lineEnd, long width, char * lineHex, unsigned char * dest)
+{
+    long digits = 0;
+
+    if (width <= 0 || width % 2 != 0) return -1;
+    for (; g + width <= lineEnd && (g + width == lineEnd || g[width] == ' '); g += width + 1)
+    {
+        if (width <= 16) memcpy(lineHex + digits, g, 16);
+        else memcpy(lineHex + digits, g, width);
+        digits += width;
+    }
+    while (g < lineEnd && *g == ' ') g++;
+    if (digits == 0 || (g < lineEnd && *g != SEPARATOR)) return -1;
+    return decodeHex(lineHex, digits / 2, dest);
+}
+
+/* --undump. Reads a dump in the --dump layout back into binary on stdout. The offset at the start of each
+ * line is honoured, by seeking when stdout is a file or padding with zeros when it's a pipe.
+ * Lines laid out the way --dump writes them have their groups gathered up and decoded with decodeHex in one
+ * go. Anything else, like a hand edited line, is looked up a pair of digits at a time. */
+int undumpFile()
+{
+    /* slack on the end for the 16 byte copies of the last group*/
+    char * text = malloc(STREAM_BUFFER_SIZE + 16);
+    char * lineHex = malloc(STREAM_BUFFER_SIZE + 16);
+    unsigned char * outBuf = malloc(STREAM_BUFFER_SIZE);
+    unsigned char zeros[0x1000];
+    signed char hexValues[256];
+    long have = 0, n = 0, outLen = 0, lineNumber = 0, run, lineStart, width = 0;
+    unsigned long outPos = 0, offset;
+    char * p;
+    char * q;
+    char * g;
+    char * lineEnd;
+    char * newline;
+    int inFd, seekable, high, low, eof = 0, ret = 0;
+    gzFile in = NULL;
+
+    inFd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (inFd < 0)
+    {
+        fprintf(stderr, "%s: Couldn't open %s.\n", PROG_NAME, filename);
+        free(text);
+        free(lineHex);
+        free(outBuf);
+        return -1;
+    }
+    in = gzdopen(inFd, "rb");
+    seekable = lseek(STDOUT_FILENO, 0, SEEK_CUR) >= 0;
+    memset(zeros, 0, sizeof(zeros));
+    for (run = 0; run < 256; run++)
+    {
+        hexValues[run] = hexValue(run);
+    }
+    if (in == NULL || text == NULL || lineHex == NULL || outBuf == NULL)
+    {
+        fprintf(stderr, "%s: Out of memory.\n", PROG_NAME);
+        ret = -1;
+    }
+    else gzbuffer(in, STREAM_BUFFER_SIZE);
+
+    while (ret == 0 && !eof)
+    {
+        n = readFully(inFd, in, (unsigned char *) text + have, STREAM_BUFFER_SIZE - have);
+        if (n < 0)
+        {
+            fprintf(stderr, "%s: Couldn't read %s.\n", PROG_NAME, filename);
+            ret = -1;
+            break;
+        }
+        eof = n < STREAM_BUFFER_SIZE - have;
+        have += n;
+
+        p = text;
+        while (ret == 0 && p < text + have)
+        {
+            newline = memchr(p, '\n', text + have - p);
+            if (newline == NULL && !eof) break; /* partial line, wait for the rest*/
+            lineEnd = newline != NULL ? newline : text + have;
+            lineNumber++;
+            q = p;
+            p = newline != NULL ? newline + 1 : lineEnd;
+            if (lineEnd > q && lineEnd[-1] == '\r') lineEnd--;
+            if (lineEnd == q) continue;
+
+            /* 0x<offset> | <hex groups> [| ascii]*/
+            if (lineEnd - q < 2 || q[0] != '0' || (q[1] != 'x' && q[1] != 'X'))
+            {
+                fprintf(stderr, "%s: Line %ld doesn't start with an offset.\n", PROG_NAME, lineNumber);
+                ret = -1;
+                break;
+            }
+            offset = 0;
+            for (q += 2; q < lineEnd && hexValues[(unsigned char) *q] >= 0; q++)
+            {
+                offset = (offset << 4) | hexValues[(unsigned char) *q];
+            }
+            q = memchr(q, SEPARATOR, lineEnd - q);
+            if (q == NULL)
+            {
+                fprintf(stderr, "%s: Line %ld has no '%c' after the offset.\n", PROG_NAME, lineNumber, SEPARATOR);
+                ret = -1;
+                break;
+            }
+            q++;
+
+            if (offset != outPos)
+            {
+                if (flushUndump(outBuf, &outLen))
+                {
+                    ret = -1;
+                    break;
+                }
+                if (seekable)
+                {
+                    if (lseek(STDOUT_FILENO, offset, SEEK_SET) < 0)
+                    {
+                        fprintf(stderr, "%s: Couldn't seek to 0x%lX.\n", PROG_NAME, offset);
+                        ret = -1;
+                        break;
+                    }
+                }
+                else if (offset < outPos)
+                {
+                    fprintf(stderr, "%s: Line %ld goes backwards, which needs the output to be a file.\n", PROG_NAME, lineNumber);
+                    ret = -1;
+                    break;
+                }
+                else
+                {
+                    for (; outPos < offset; outPos += run)
+                    {
+                        run = leastOf(sizeof(zeros), offset - outPos);
+                        if (writeFully(STDOUT_FILENO, zeros, run))
+                        {
+                            fprintf(stderr, "%s: Couldn't write the output.\n", PROG_NAME);
+                            ret = -1;
+                            break;
+                        }
+                    }
+                    if (ret != 0) break;
+                }
+                outPos = offset;
+            }
+
+            /* a line fits in the text buffer, so it has at most half that many bytes*/
+            if (outLen + (lineEnd - q) / 2 > STREAM_BUFFER_SIZE && flushUndump(outBuf, &outLen))
+            {
+                ret = -1;
+                break;
+            }
+            lineStart = outLen;
+
+            /* groups almost always come as wide as on the line before, and otherwise as wide as the first one*/
+            g = q < lineEnd && *q == ' ' ? q + 1 : q;
+            run = decodeGroups(g, lineEnd, width, lineHex, outBuf + outLen);
+            if (run < 0)
+            {
+                width = hexRunLength(g, lineEnd - g);
+                run = decodeGroups(g, lineEnd, width, lineHex, outBuf + outLen);
+            }
+            if (run > 0)
+            {
+                outLen += run;
+                outPos += run;
+                continue;
+            }
+
+            /* the groups up to the ASCII column's separator*/
+            while (q < lineEnd && *q != SEPARATOR)
+            {
+                if (*q == ' ')
+                {
+                    q++;
+                    continue;
+                }
+                if (q + 1 == lineEnd) break;
+                high = hexValues[(unsigned char) q[0]];
+                low = hexValues[(unsigned char) q[1]];
+                if ((high | low) < 0) break;
+                outBuf[outLen++] = (high << 4) | low;
+                q += 2;
+            }
+            if (q < lineEnd && *q != SEPARATOR)
+            {
+                fprintf(stderr, "%s: Line %ld has a bad hex value.\n", PROG_NAME, lineNumber);
+                ret = -1;
+                break;
+            }
+            outPos += outLen - lineStart;
+        }
+        if (ret != 0) break;
+
+        /* keep the partial line for the next read*/
+        have = text + have - p;
+        memmove(text, p, have);
+        if (have == STREAM_BUFFER_SIZE)
+        {
+            fprintf(stderr, "%s: Line %ld is too long.\n", PROG_NAME, lineNumber + 1);
+            ret = -1;
+        }
+    }
+    if (ret == 0 && flushUndump(outBuf, &outLen)) ret = -1;
+
+    free(text);
+    free(lineHex);
+    free(outBuf);
+    if (in != NULL) gzclose(in);
+    else if (inFd != STDIN_FILENO) close(inFd);
+    return ret;
+}